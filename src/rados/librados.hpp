@@ -25,6 +25,9 @@ namespace librados {
 
     bool is_valid() const {}
 
+    // Create an io context with the same settings but a new IoCtxImpl
+    void dup(const IoCtx& rhs) {}
+
     // Close our pool handle
     void close() {}
 
@@ -51,6 +54,7 @@ namespace librados {
     config_t cct() {}
 
     int connect() {}
+    int cluster_fsid(std::string *fsid) {}
     void shutdown() {}
 
     int conf_read_file(const char * const path) const {}
@@ -1,11 +1,11 @@
 #include <pybind11/pybind11.h>
 
 #include "../rados/librados.hpp"
+#include "radosx.h"
 
-#include <algorithm>
-#include <list>
+#include <memory>
+#include <stdexcept>
 #include <string>
-#include <vector>
 
 namespace py = pybind11;
 
@@ -16,15 +16,21 @@ using namespace librados;
 // it is defined as uint64_t in ceph C++ code
 constexpr int64_t CEPH_NOSNAP = ((int64_t)(-2));
 
+// all the methods can be called concurrently, ops admitted in a state,
+// including the ones made on the xIoCtx created from us, are waited for by
+// `shutdown`, which rejects new ops as soon as it starts
 class xRados : public Rados {
 public:
   ~xRados() {
+    // we are only destroyed by python, i.e., with the GIL held, which the
+    // ops in flight need to return
+    py::gil_scoped_release release;
     shutdown();
   }
 
   int from_rados(py::handle h_rados) {
-    int r = require_state({"shutdown"});
-    if (r < 0) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (gate->state != state_t::SHUTDOWN) {
       return -EEXIST;
     }
     // if the rados.Rados instance was shutdown by Cython code, then the
@@ -32,112 +38,184 @@ public:
     // are still in the "connected" state, so always remember to shutdown
     // xRados instance before rados.Rados instance
     auto* ptr = h_rados.ptr();
+    if (!PyCapsule_IsValid(ptr, "rados")) {
+      return -EINVAL;
+    }
     auto* c_rados = reinterpret_cast<rados_t*>(PyCapsule_GetPointer(ptr, "rados"));
     Rados::from_rados_t(c_rados, *this);
-    state = "connected";
+    gate->epoch++;
+    gate->state = state_t::CONNECTED;
     return 0;
   }
 
   // assume client.id
   int init(const char * const id) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (gate->state != state_t::SHUTDOWN) {
+      return -EBADF;
+    }
     int r = Rados::init(id);
     if (r < 0) {
       return r;
     }
-    state = "configuring";
+    gate->state = state_t::CONFIGURING;
     return 0;
   }
   // parse type.id from name
   int init2(const char * const name) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (gate->state != state_t::SHUTDOWN) {
+      return -EBADF;
+    }
     int r = Rados::init2(name, "", 0);
     if (r < 0) {
       return r;
     }
-    state = "configuring";
+    gate->state = state_t::CONFIGURING;
     return 0;
   }
   int init_with_context(config_t cct) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (gate->state != state_t::SHUTDOWN) {
+      return -EBADF;
+    }
     int r = Rados::init_with_context(cct);
     if (r < 0) {
       return r;
     }
-    state = "configuring";
+    gate->state = state_t::CONFIGURING;
     return 0;
   }
 
   config_t cct() {
-    int r = require_state({"configuring", "connected"});
-    if (r < 0) {
+    op_t op(gate.get(), {state_t::CONFIGURING, state_t::CONNECTED});
+    if (op.r < 0) {
       return nullptr;
     }
     return Rados::cct();
   }
 
   int conf_read_file(const char * const path) const {
-    int r = require_state({"configuring", "connected"});
-    if (r < 0) {
-      return r;
+    op_t op(gate.get(), {state_t::CONFIGURING, state_t::CONNECTED});
+    if (op.r < 0) {
+      return op.r;
     }
     return Rados::conf_read_file(path);
   }
   int conf_set(const char *option, const char *value) {
-    int r = require_state({"configuring", "connected"});
-    if (r < 0) {
-      return r;
+    op_t op(gate.get(), {state_t::CONFIGURING, state_t::CONNECTED});
+    if (op.r < 0) {
+      return op.r;
     }
     return Rados::conf_set(option, value);
   }
 
   int connect() {
-    int r = require_state({"configuring"});
-    if (r < 0) {
-      return r;
+    {
+      std::lock_guard<std::mutex> l(gate->lock);
+      if (gate->state != state_t::CONFIGURING) {
+        return -EBADF;
+      }
+      gate->state = state_t::CONNECTING;
     }
-    r = Rados::connect();
-    if (r < 0) {
-      return r;
+    int r = Rados::connect();
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (r == 0) {
+      gate->epoch++;
     }
-    state = "connected";
-    return 0;
+    gate->state = (r < 0) ? state_t::CONFIGURING : state_t::CONNECTED;
+    gate->cond.notify_all();
+    return (r < 0) ? r : 0;
+  }
+
+  // wait for the ops in flight and move to "shutting_down", return false
+  // if there is nothing to shutdown
+  bool shutdown_wait() {
+    std::unique_lock<std::mutex> l(gate->lock);
+    gate->cond.wait(l, [this] {
+      return gate->state != state_t::CONNECTING &&
+          gate->state != state_t::SHUTTING_DOWN;
+    });
+    if (gate->state == state_t::SHUTDOWN) {
+      return false;
+    }
+    gate->state = state_t::SHUTTING_DOWN;
+    gate->cond.wait(l, [this] {
+      return gate->inflight == 0;
+    });
+    return true;
+  }
+  void shutdown_finish() {
+    Rados::shutdown();
+    std::lock_guard<std::mutex> l(gate->lock);
+    gate->state = state_t::SHUTDOWN;
+    gate->cond.notify_all();
   }
   void shutdown() {
-    if (state != "shutdown") {
-      Rados::shutdown();
-      state = "shutdown";
+    if (shutdown_wait()) {
+      shutdown_finish();
     }
   }
 
-  int ioctx_create(const char *name, IoCtx &pioctx) {
-    int r = require_state({"connected"});
+  int ioctx_create(const char *name, xIoCtx &pioctx) {
+    op_t op(gate.get(), {state_t::CONNECTED});
+    if (op.r < 0) {
+      return op.r;
+    }
+    int r = Rados::ioctx_create(name, pioctx);
     if (r < 0) {
       return r;
     }
-    return Rados::ioctx_create(name, pioctx);
+    Rados::cluster_fsid(&pioctx.fsid);
+    pioctx.gate = gate;
+    pioctx.epoch = op.epoch;
+    return 0;
   }
-  int ioctx_create2(int64_t pool_id, IoCtx &pioctx) {
-    int r = require_state({"connected"});
+  int ioctx_create2(int64_t pool_id, xIoCtx &pioctx) {
+    op_t op(gate.get(), {state_t::CONNECTED});
+    if (op.r < 0) {
+      return op.r;
+    }
+    int r = Rados::ioctx_create2(pool_id, pioctx);
     if (r < 0) {
       return r;
     }
-    return Rados::ioctx_create2(pool_id, pioctx);
+    Rados::cluster_fsid(&pioctx.fsid);
+    pioctx.gate = gate;
+    pioctx.epoch = op.epoch;
+    return 0;
   }
 
   std::string get_state() const {
-    return state;
+    switch (gate->state.load()) {
+    case state_t::SHUTDOWN:
+      return "shutdown";
+    case state_t::CONFIGURING:
+      return "configuring";
+    case state_t::CONNECTING:
+      return "connecting";
+    case state_t::CONNECTED:
+      return "connected";
+    case state_t::SHUTTING_DOWN:
+      return "shutting_down";
+    default:
+      return "unknown";
+    }
   }
 
 private:
-  std::string state = "shutdown";
+  std::shared_ptr<gate_t> gate = std::make_shared<gate_t>();
+};
 
-  int require_state(std::list<std::string>&& states) const {
-    if (std::find_if(states.begin(), states.end(), [this](const std::string& s) {
-      return s == state;
-    }) == states.end()) {
-      return -EBADF;
-    }
-    return 0;
+// for an xIoCtx from a rados.Ioctx capsule, the temporary reference on
+// the RadosClient is dropped right away while rados.Rados still holds its
+// own, which it must as the capsule is in use
+void set_fsid(xIoCtx& ioctx) {
+  ioctx.fsid.clear();
+  if (ioctx.is_valid()) {
+    Rados(ioctx).cluster_fsid(&ioctx.fsid);
   }
-};
+}
 
 PYBIND11_MODULE(radosx, m) {
 
@@ -155,6 +233,9 @@ PYBIND11_MODULE(radosx, m) {
     cls.def("init2", &xRados::init2);
     cls.def("init_with_context", [](xRados& self, py::handle h_rados_cct) {
       auto* ptr = h_rados_cct.ptr();
+      if (!PyCapsule_IsValid(ptr, "rados")) {
+        return -EINVAL;
+      }
       auto* c_cct = reinterpret_cast<config_t*>(PyCapsule_GetPointer(ptr, "rados"));
       return self.init_with_context(c_cct);
     });
@@ -163,64 +244,85 @@ PYBIND11_MODULE(radosx, m) {
       // default policy is return_value_policy::automatic_reference
       return py::cast(cct);
     }, py::return_value_policy::reference);
-    cls.def("conf_read_file", &xRados::conf_read_file);
+    cls.def("conf_read_file", &xRados::conf_read_file,
+        py::call_guard<py::gil_scoped_release>());
     cls.def("conf_set", &xRados::conf_set);
-    cls.def("connect", &xRados::connect);
-    cls.def("shutdown", &xRados::shutdown);
-    cls.def("ioctx_create", &xRados::ioctx_create);
-    cls.def("ioctx_create2", &xRados::ioctx_create2);
+    cls.def("connect", &xRados::connect,
+        py::call_guard<py::gil_scoped_release>());
+    // waits for the rbdx calls in flight on the xIoCtx created from us
+    cls.def("shutdown", &xRados::shutdown,
+        py::call_guard<py::gil_scoped_release>());
+    cls.def("ioctx_create", &xRados::ioctx_create,
+        py::call_guard<py::gil_scoped_release>());
+    cls.def("ioctx_create2", &xRados::ioctx_create2,
+        py::call_guard<py::gil_scoped_release>());
   }
 
   //
   // IoCtx
   //
+  // rbdx calls take a private handle of the pool (IoCtx::dup) when they
+  // start, so `close` and `set_namespace` are safe against them, the calls
+  // in flight keep the namespace they started with. the calls on an xIoCtx
+  // from a rados.Ioctx capsule are not waited for by anyone, so rados.Rados
+  // must not be shutdown while they are in flight
+  //
   {
-    py::class_<IoCtx> cls(m, "xIoCtx");
+    py::class_<xIoCtx> cls(m, "xIoCtx");
     cls.def(py::init<>());
     cls.def(py::init([](py::handle h_rados_ioctx) {
       auto* ptr = h_rados_ioctx.ptr();
+      if (!PyCapsule_IsValid(ptr, "ioctx")) {
+        throw std::invalid_argument("not an ioctx capsule");
+      }
       auto* c_ioctx = reinterpret_cast<rados_ioctx_t*>(PyCapsule_GetPointer(ptr, "ioctx"));
-      auto ioctx = new IoCtx{};
+      auto ioctx = new xIoCtx{};
       IoCtx::from_rados_ioctx_t(c_ioctx, *ioctx);
-      return std::unique_ptr<IoCtx>{ioctx};
+      set_fsid(*ioctx);
+      return std::unique_ptr<xIoCtx>{ioctx};
     }));
-    cls.def("__enter__", [](IoCtx& self) {
+    cls.def("__enter__", [](xIoCtx& self) {
       return self;
     });
-    cls.def("__exit__", [](IoCtx& self, py::args) {
+    cls.def("__exit__", [](xIoCtx& self, py::args) {
       self.close();
     });
-    cls.def("from_rados_ioctx", [](IoCtx& self, py::handle h_rados_ioctx) {
+    cls.def("from_rados_ioctx", [](xIoCtx& self, py::handle h_rados_ioctx) {
       if (self.is_valid()) {
         return -EEXIST;
       }
       auto* ptr = h_rados_ioctx.ptr();
+      if (!PyCapsule_IsValid(ptr, "ioctx")) {
+        return -EINVAL;
+      }
       auto* c_ioctx = reinterpret_cast<rados_ioctx_t*>(PyCapsule_GetPointer(ptr, "ioctx"));
       IoCtx::from_rados_ioctx_t(c_ioctx, self);
+      self.gate.reset();
+      set_fsid(self);
       return 0;
     });
-    cls.def("cct", [](IoCtx& self) {
+    cls.def("cct", [](xIoCtx& self) {
       if (!self.is_valid()) {
         return py::cast(nullptr);
       }
       auto cct = self.cct();
       return py::cast(cct);
     }, py::return_value_policy::reference);
-    cls.def("set_namespace", [](IoCtx& self, const std::string nspace) {
+    cls.def("set_namespace", [](xIoCtx& self, const std::string nspace) {
       if (!self.is_valid()) {
         return -EBADF;
       }
       self.set_namespace(nspace);
       return 0;
     });
-    cls.def("get_namespace", [](const IoCtx& self) {
+    cls.def("get_namespace", [](const xIoCtx& self) {
       if (!self.is_valid()) {
         return py::cast(nullptr);
       }
       auto nspace = self.get_namespace();
       return py::cast(nspace);
     });
-    cls.def("get_id", [](IoCtx& self) {
+    cls.def("get_id", [](xIoCtx& self) {
       if (!self.is_valid()) {
         return int64_t(-1);
       }
@@ -0,0 +1,102 @@
+/*
+ * radosx.h
+ */
+
+#ifndef SRC_RADOSX_RADOSX_H_
+#define SRC_RADOSX_RADOSX_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../rados/librados.hpp"
+
+namespace radosx {
+
+enum class state_t : uint8_t {
+  SHUTDOWN,
+  CONFIGURING,
+  CONNECTING,
+  CONNECTED,
+  SHUTTING_DOWN,
+};
+
+// state of an xRados and the ops admitted in it, shared with the xIoCtx
+// created from it, so the ops made on an xIoCtx, e.g., the rbdx calls, are
+// waited for by `xRados.shutdown` too and rejected once it starts
+struct gate_t {
+  // protects state transitions, `inflight` and `epoch`, `state` is atomic
+  // so it can be peeked without the lock
+  std::mutex lock;
+  std::condition_variable cond;
+  uint64_t inflight = 0;
+  // bumped on each connect, so an xIoCtx from a previous connection is
+  // not admitted after the xRados reconnects
+  uint64_t epoch = 0;
+  std::atomic<state_t> state{state_t::SHUTDOWN};
+};
+
+// admitted if in one of `states` (and `epoch` if given) on construction,
+// r is -EBADF otherwise
+class op_t {
+public:
+  op_t(gate_t* gate, std::initializer_list<state_t> states)
+    : gate(gate) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (std::find(states.begin(), states.end(), gate->state.load()) == states.end()) {
+      r = -EBADF;
+      return;
+    }
+    epoch = gate->epoch;
+    gate->inflight++;
+  }
+  op_t(gate_t* gate, uint64_t epoch)
+    : gate(gate) {
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (gate->state != state_t::CONNECTED || gate->epoch != epoch) {
+      r = -EBADF;
+      return;
+    }
+    this->epoch = epoch;
+    gate->inflight++;
+  }
+  ~op_t() {
+    if (r < 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> l(gate->lock);
+    if (--gate->inflight == 0) {
+      gate->cond.notify_all();
+    }
+  }
+
+  op_t(const op_t&) = delete;
+  op_t& operator=(const op_t&) = delete;
+
+  int r = 0;
+  uint64_t epoch = 0;
+
+private:
+  gate_t* gate;
+};
+
+// an IoCtx that knows the xRados it was created from, `gate` is null for
+// the ones from a rados.Ioctx capsule, whose RadosClient is owned by the
+// rados.Rados instance, so the caller must not shut it down while there
+// are calls in flight
+struct xIoCtx : public librados::IoCtx {
+  std::shared_ptr<gate_t> gate;
+  uint64_t epoch = 0;
+  // of the cluster, scopes what is cached per pool, e.g., the rbdx id cache
+  std::string fsid;
+};
+
+} // namespace radosx
+
+#endif /* SRC_RADOSX_RADOSX_H_ */
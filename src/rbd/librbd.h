@@ -25,6 +25,13 @@ extern "C" {
   #define CEPH_RBD_API
 #endif
 
+typedef enum {
+  RBD_TRASH_IMAGE_SOURCE_USER = 0,
+  RBD_TRASH_IMAGE_SOURCE_MIRRORING = 1,
+  RBD_TRASH_IMAGE_SOURCE_MIGRATION = 2,
+  RBD_TRASH_IMAGE_SOURCE_REMOVING = 3,
+} rbd_trash_image_source_t;
+
 #ifdef __cplusplus
 }
 #endif
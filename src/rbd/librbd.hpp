@@ -0,0 +1,51 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.	See file COPYING.
+ *
+ */
+
+#ifndef __LIBRBD_HPP
+#define __LIBRBD_HPP
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "../rados/librados.hpp"
+#include "librbd.h"
+
+namespace librbd {
+
+  using librados::IoCtx;
+
+  typedef struct {
+    std::string id;
+    std::string name;
+    rbd_trash_image_source_t source;
+    time_t deletion_time;
+    time_t deferment_end_time;
+  } trash_image_info_t;
+
+class CEPH_RBD_API RBD
+{
+public:
+  RBD() {}
+  ~RBD() {}
+
+  int trash_list(IoCtx &io_ctx, std::vector<trash_image_info_t> &entries) {}
+
+  // the namespaces other than the default one
+  int namespace_list(IoCtx& io_ctx, std::vector<std::string>* namespace_names) {}
+};
+
+}
+
+#endif
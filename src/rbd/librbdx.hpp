@@ -22,14 +22,14 @@ namespace librbdx {
 template<typename E> struct Enable : std::false_type { };
 
 template<typename E>
-typename std::enable_if<Enable<typename std::decay<E>::type>::value, E>::type
+constexpr typename std::enable_if<Enable<typename std::decay<E>::type>::value, E>::type
 operator&(E lhs, E rhs) {
   using T = typename std::underlying_type<E>::type;
   return static_cast<E>(static_cast<T>(lhs) & static_cast<T>(rhs));
 }
 
 template<typename E>
-typename std::enable_if<Enable<typename std::decay<E>::type>::value, E>::type
+constexpr typename std::enable_if<Enable<typename std::decay<E>::type>::value, E>::type
 operator|(E lhs, E rhs) {
   using T = typename std::underlying_type<E>::type;
   return static_cast<E>(static_cast<T>(lhs) | static_cast<T>(rhs));
@@ -160,6 +160,8 @@ struct image_info_t {
   int64_t dirty;
 };
 
+// `image_id` takes precedence, if it is not empty `image_name` is not
+// resolved but taken as is
 CEPH_RBD_API int get_info(librados::IoCtx& ioctx,
     const std::string& image_name,
     const std::string& image_id,
@@ -0,0 +1,71 @@
+/*
+ * deadline.h
+ */
+
+#ifndef SRC_RBDX_DEADLINE_H_
+#define SRC_RBDX_DEADLINE_H_
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+
+namespace rbdx {
+
+using deadline_t = std::chrono::steady_clock::time_point;
+
+// shared between the caller and an in-flight get_info/list_info, `cancel`
+// can be called from any thread
+class cancel_token_t {
+public:
+  cancel_token_t() = default;
+  // also canceled when `parent` is, which must outlive it, while canceling
+  // it leaves `parent` alone
+  explicit cancel_token_t(const cancel_token_t* parent) : parent(parent) {}
+
+  void cancel() {
+    canceled.store(true, std::memory_order_release);
+  }
+  bool is_canceled() const {
+    return canceled.load(std::memory_order_acquire) ||
+        (parent != nullptr && parent->is_canceled());
+  }
+
+private:
+  std::atomic<bool> canceled{false};
+  const cancel_token_t* parent = nullptr;
+};
+
+// timeout in seconds, non-positive (or NaN) means wait forever, so does a
+// timeout too large for the clock, e.g., float('inf')
+inline deadline_t make_deadline(double timeout) {
+  if (!(timeout > 0)) {
+    return deadline_t::max();
+  }
+  auto now = deadline_t::clock::now();
+  // halved, so the rounding of the double can not take `now` + timeout
+  // past the end of the clock
+  std::chrono::duration<double> left = (deadline_t::max() - now) / 2;
+  if (timeout >= left.count()) {
+    return deadline_t::max();
+  }
+  return now + std::chrono::duration_cast<deadline_t::duration>(
+      std::chrono::duration<double>(timeout));
+}
+
+// -ECANCELED if `token` is canceled, -ETIMEDOUT if `deadline` has expired,
+// 0 otherwise
+inline int check_deadline(const deadline_t& deadline,
+    const cancel_token_t* token) {
+  if (token != nullptr && token->is_canceled()) {
+    return -ECANCELED;
+  }
+  if (deadline != deadline_t::max() &&
+      deadline_t::clock::now() >= deadline) {
+    return -ETIMEDOUT;
+  }
+  return 0;
+}
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_DEADLINE_H_ */
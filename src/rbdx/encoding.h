@@ -0,0 +1,509 @@
+/*
+ * encoding.h
+ */
+
+#ifndef SRC_RBDX_ENCODING_H_
+#define SRC_RBDX_ENCODING_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+#include "pool.h"
+
+namespace rbdx {
+
+// bump `ENCODING_V` for every layout change, bump `ENCODING_COMPAT_V` too
+// unless the change only appends data to the end of the blob
+constexpr uint8_t ENCODING_V = 1;
+constexpr uint8_t ENCODING_COMPAT_V = 1;
+
+// integers are LEB128 varints, signed integers are zigzag encoded first,
+// strings and containers are prefixed with their varint length
+class encoder_t {
+public:
+  explicit encoder_t(std::string* bl) : bl(bl) {}
+
+  void put_u8(uint8_t v) {
+    bl->push_back(static_cast<char>(v));
+  }
+  void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+      bl->push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    bl->push_back(static_cast<char>(v));
+  }
+  void put_svarint(int64_t v) {
+    put_varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+  }
+  void put_bytes(const char* p, size_t len) {
+    put_varint(len);
+    bl->append(p, len);
+  }
+
+private:
+  std::string* bl;
+};
+
+class decoder_t {
+public:
+  decoder_t(const char* p, size_t len) : p(p), end(p + len) {}
+
+  bool get_u8(uint8_t* v) {
+    if (p == end) {
+      return false;
+    }
+    *v = static_cast<uint8_t>(*p++);
+    return true;
+  }
+  bool get_varint(uint64_t* v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end) {
+        return false;
+      }
+      auto b = static_cast<uint8_t>(*p++);
+      r |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        *v = r;
+        return true;
+      }
+    }
+    return false;
+  }
+  bool get_svarint(int64_t* v) {
+    uint64_t u;
+    if (!get_varint(&u)) {
+      return false;
+    }
+    *v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+    return true;
+  }
+  bool get_bytes(std::string* s) {
+    uint64_t len;
+    if (!get_varint(&len) || len > static_cast<uint64_t>(end - p)) {
+      return false;
+    }
+    s->assign(p, len);
+    p += len;
+    return true;
+  }
+  bool get_length(uint64_t* len) {
+    // every element takes at least one byte, reject bogus lengths early
+    // instead of trying to reserve them
+    return get_varint(len) && *len <= static_cast<uint64_t>(end - p);
+  }
+  // the next `len` bytes in place, for nested encodings decoded lazily
+  bool get_raw(const char** ptr, uint64_t len) {
+    if (len > static_cast<uint64_t>(end - p)) {
+      return false;
+    }
+    *ptr = p;
+    p += len;
+    return true;
+  }
+
+  bool empty() const {
+    return p == end;
+  }
+
+private:
+  const char* p;
+  const char* end;
+};
+
+// forward declaration, the container overloads below need to see the
+// overloads of the element types
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_unsigned<T>::value, std::nullptr_t>::type=nullptr
+>
+void encode(const T& o, encoder_t* e);
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_signed<T>::value, std::nullptr_t>::type=nullptr
+>
+void encode(const T& o, encoder_t* e);
+template <typename T,
+  typename std::enable_if<std::is_enum<T>::value, std::nullptr_t>::type=nullptr
+>
+void encode(const T& o, encoder_t* e);
+template <typename T1, typename T2>
+void encode(const std::pair<T1, T2>& o, encoder_t* e);
+template <typename T, typename... Ts>
+void encode(const std::vector<T, Ts...>& o, encoder_t* e);
+template <typename T, typename... Ts>
+void encode(const std::set<T, Ts...>& o, encoder_t* e);
+template <typename K, typename V, typename... Ts>
+void encode(const std::map<K, V, Ts...>& o, encoder_t* e);
+inline void encode(const std::string& o, encoder_t* e);
+inline void encode(const librbdx::parent_t& o, encoder_t* e);
+inline void encode(const librbdx::child_t& o, encoder_t* e);
+inline void encode(const librbdx::snap_info_t& o, encoder_t* e);
+inline void encode(const librbdx::image_info_t& o, encoder_t* e);
+inline void encode(const image_source_t& o, encoder_t* e);
+inline void encode(const pool_image_info_t& o, encoder_t* e);
+
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_unsigned<T>::value, std::nullptr_t>::type=nullptr
+>
+bool decode(T* o, decoder_t* d);
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_signed<T>::value, std::nullptr_t>::type=nullptr
+>
+bool decode(T* o, decoder_t* d);
+template <typename T,
+  typename std::enable_if<std::is_enum<T>::value, std::nullptr_t>::type=nullptr
+>
+bool decode(T* o, decoder_t* d);
+template <typename T1, typename T2>
+bool decode(std::pair<T1, T2>* o, decoder_t* d);
+template <typename T, typename... Ts>
+bool decode(std::vector<T, Ts...>* o, decoder_t* d);
+template <typename T, typename... Ts>
+bool decode(std::set<T, Ts...>* o, decoder_t* d);
+template <typename K, typename V, typename... Ts>
+bool decode(std::map<K, V, Ts...>* o, decoder_t* d);
+inline bool decode(std::string* o, decoder_t* d);
+inline bool decode(librbdx::parent_t* o, decoder_t* d);
+inline bool decode(librbdx::child_t* o, decoder_t* d);
+inline bool decode(librbdx::snap_info_t* o, decoder_t* d);
+inline bool decode(librbdx::image_info_t* o, decoder_t* d);
+inline bool decode(image_source_t* o, decoder_t* d);
+inline bool decode(pool_image_info_t* o, decoder_t* d);
+
+//
+// encode
+//
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_unsigned<T>::value, std::nullptr_t>::type
+>
+void encode(const T& o, encoder_t* e) {
+  e->put_varint(o);
+}
+
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_signed<T>::value, std::nullptr_t>::type
+>
+void encode(const T& o, encoder_t* e) {
+  e->put_svarint(o);
+}
+
+template <typename T,
+  typename std::enable_if<std::is_enum<T>::value, std::nullptr_t>::type
+>
+void encode(const T& o, encoder_t* e) {
+  using U = typename std::underlying_type<T>::type;
+  encode(static_cast<U>(o), e);
+}
+
+template <typename T1, typename T2>
+void encode(const std::pair<T1, T2>& o, encoder_t* e) {
+  encode(o.first, e);
+  encode(o.second, e);
+}
+
+template <typename T, typename... Ts>
+void encode(const std::vector<T, Ts...>& o, encoder_t* e) {
+  e->put_varint(o.size());
+  for (auto& i : o) {
+    encode(i, e);
+  }
+}
+
+template <typename T, typename... Ts>
+void encode(const std::set<T, Ts...>& o, encoder_t* e) {
+  e->put_varint(o.size());
+  for (auto& i : o) {
+    encode(i, e);
+  }
+}
+
+template <typename K, typename V, typename... Ts>
+void encode(const std::map<K, V, Ts...>& o, encoder_t* e) {
+  e->put_varint(o.size());
+  for (auto& it : o) {
+    encode(it.first, e);
+    encode(it.second, e);
+  }
+}
+
+inline void encode(const std::string& o, encoder_t* e) {
+  e->put_bytes(o.data(), o.size());
+}
+
+inline void encode(const librbdx::parent_t& o, encoder_t* e) {
+  encode(o.pool_id, e);
+  encode(o.pool_namespace, e);
+  encode(o.image_id, e);
+  // CEPH_NOSNAP costs 10 bytes unsigned, 1 byte zigzag encoded
+  encode(static_cast<int64_t>(o.snap_id), e);
+}
+
+inline void encode(const librbdx::child_t& o, encoder_t* e) {
+  encode(o.pool_id, e);
+  encode(o.pool_namespace, e);
+  encode(o.image_id, e);
+}
+
+inline void encode(const librbdx::snap_info_t& o, encoder_t* e) {
+  encode(o.name, e);
+  encode(o.id, e);
+  encode(o.snap_type, e);
+  encode(o.size, e);
+  encode(o.flags, e);
+  encode(o.protection_status, e);
+  encode(o.timestamp, e);
+  encode(o.children, e);
+  encode(o.du, e);
+  encode(o.dirty, e);
+}
+
+inline void encode(const librbdx::image_info_t& o, encoder_t* e) {
+  encode(o.name, e);
+  encode(o.id, e);
+  encode(o.order, e);
+  encode(o.size, e);
+  encode(o.features, e);
+  encode(o.op_features, e);
+  encode(o.flags, e);
+  encode(o.snaps, e);
+  encode(o.parent, e);
+  encode(o.create_timestamp, e);
+  encode(o.access_timestamp, e);
+  encode(o.modify_timestamp, e);
+  encode(o.data_pool_id, e);
+  encode(o.watchers, e);
+  encode(o.metas, e);
+  encode(o.du, e);
+  encode(o.dirty, e);
+}
+
+inline void encode(const image_source_t& o, encoder_t* e) {
+  encode(o.pool_namespace, e);
+  encode(o.state, e);
+  encode(o.deletion_timestamp, e);
+  encode(o.deferment_end_timestamp, e);
+}
+
+inline void encode(const pool_image_info_t& o, encoder_t* e) {
+  encode(o.source, e);
+  encode(o.info, e);
+}
+
+//
+// decode
+//
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_unsigned<T>::value, std::nullptr_t>::type
+>
+bool decode(T* o, decoder_t* d) {
+  uint64_t v;
+  if (!d->get_varint(&v)) {
+    return false;
+  }
+  *o = static_cast<T>(v);
+  return true;
+}
+
+template <typename T,
+  typename std::enable_if<std::is_integral<T>::value &&
+      std::is_signed<T>::value, std::nullptr_t>::type
+>
+bool decode(T* o, decoder_t* d) {
+  int64_t v;
+  if (!d->get_svarint(&v)) {
+    return false;
+  }
+  *o = static_cast<T>(v);
+  return true;
+}
+
+template <typename T,
+  typename std::enable_if<std::is_enum<T>::value, std::nullptr_t>::type
+>
+bool decode(T* o, decoder_t* d) {
+  typename std::underlying_type<T>::type v;
+  if (!decode(&v, d)) {
+    return false;
+  }
+  *o = static_cast<T>(v);
+  return true;
+}
+
+template <typename T1, typename T2>
+bool decode(std::pair<T1, T2>* o, decoder_t* d) {
+  return decode(&o->first, d) && decode(&o->second, d);
+}
+
+template <typename T, typename... Ts>
+bool decode(std::vector<T, Ts...>* o, decoder_t* d) {
+  uint64_t n;
+  if (!d->get_length(&n)) {
+    return false;
+  }
+  o->clear();
+  o->resize(n);
+  for (auto& i : *o) {
+    if (!decode(&i, d)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename T, typename... Ts>
+bool decode(std::set<T, Ts...>* o, decoder_t* d) {
+  uint64_t n;
+  if (!d->get_length(&n)) {
+    return false;
+  }
+  o->clear();
+  while (n--) {
+    T i;
+    if (!decode(&i, d)) {
+      return false;
+    }
+    // encoded in order, so always append
+    o->emplace_hint(o->end(), std::move(i));
+  }
+  return true;
+}
+
+template <typename K, typename V, typename... Ts>
+bool decode(std::map<K, V, Ts...>* o, decoder_t* d) {
+  uint64_t n;
+  if (!d->get_length(&n)) {
+    return false;
+  }
+  o->clear();
+  while (n--) {
+    K k;
+    if (!decode(&k, d)) {
+      return false;
+    }
+    auto it = o->emplace_hint(o->end(), std::move(k), V{});
+    if (!decode(&it->second, d)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool decode(std::string* o, decoder_t* d) {
+  return d->get_bytes(o);
+}
+
+inline bool decode(librbdx::parent_t* o, decoder_t* d) {
+  int64_t snap_id;
+  if (!(decode(&o->pool_id, d) &&
+      decode(&o->pool_namespace, d) &&
+      decode(&o->image_id, d) &&
+      decode(&snap_id, d))) {
+    return false;
+  }
+  o->snap_id = static_cast<uint64_t>(snap_id);
+  return true;
+}
+
+inline bool decode(librbdx::child_t* o, decoder_t* d) {
+  return decode(&o->pool_id, d) &&
+      decode(&o->pool_namespace, d) &&
+      decode(&o->image_id, d);
+}
+
+inline bool decode(librbdx::snap_info_t* o, decoder_t* d) {
+  return decode(&o->name, d) &&
+      decode(&o->id, d) &&
+      decode(&o->snap_type, d) &&
+      decode(&o->size, d) &&
+      decode(&o->flags, d) &&
+      decode(&o->protection_status, d) &&
+      decode(&o->timestamp, d) &&
+      decode(&o->children, d) &&
+      decode(&o->du, d) &&
+      decode(&o->dirty, d);
+}
+
+inline bool decode(librbdx::image_info_t* o, decoder_t* d) {
+  return decode(&o->name, d) &&
+      decode(&o->id, d) &&
+      decode(&o->order, d) &&
+      decode(&o->size, d) &&
+      decode(&o->features, d) &&
+      decode(&o->op_features, d) &&
+      decode(&o->flags, d) &&
+      decode(&o->snaps, d) &&
+      decode(&o->parent, d) &&
+      decode(&o->create_timestamp, d) &&
+      decode(&o->access_timestamp, d) &&
+      decode(&o->modify_timestamp, d) &&
+      decode(&o->data_pool_id, d) &&
+      decode(&o->watchers, d) &&
+      decode(&o->metas, d) &&
+      decode(&o->du, d) &&
+      decode(&o->dirty, d);
+}
+
+inline bool decode(image_source_t* o, decoder_t* d) {
+  return decode(&o->pool_namespace, d) &&
+      decode(&o->state, d) &&
+      decode(&o->deletion_timestamp, d) &&
+      decode(&o->deferment_end_timestamp, d);
+}
+
+inline bool decode(pool_image_info_t* o, decoder_t* d) {
+  return decode(&o->source, d) &&
+      decode(&o->info, d);
+}
+
+//
+// versioned blobs
+//
+template <typename T>
+std::string encode_versioned(const T& o) {
+  std::string bl;
+  encoder_t e(&bl);
+  e.put_u8(ENCODING_V);
+  e.put_u8(ENCODING_COMPAT_V);
+  encode(o, &e);
+  return bl;
+}
+
+// -EINVAL for malformed data, -EOPNOTSUPP if encoded by a newer and
+// incompatible version
+template <typename T>
+int decode_versioned(const char* p, size_t len, T* o) {
+  decoder_t d(p, len);
+  uint8_t v, compat_v;
+  if (!d.get_u8(&v) || !d.get_u8(&compat_v)) {
+    return -EINVAL;
+  }
+  if (compat_v > ENCODING_V) {
+    return -EOPNOTSUPP;
+  }
+  if (!decode(o, &d)) {
+    return -EINVAL;
+  }
+  // newer compatible versions may have appended data, ignore it
+  if (v == ENCODING_V && !d.empty()) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_ENCODING_H_ */
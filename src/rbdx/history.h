@@ -0,0 +1,946 @@
+/*
+ * history.h
+ */
+
+#ifndef SRC_RBDX_HISTORY_H_
+#define SRC_RBDX_HISTORY_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+#include "encoding.h"
+
+namespace rbdx {
+
+class history_t;
+class history_file_t;
+
+inline void encode(const history_t& o, encoder_t* e);
+inline bool decode(history_t* o, decoder_t* d);
+
+// append-only usage history of images, one series per image id
+//
+// a series is split into blocks of up to `BLOCK_SAMPLES` samples, a block
+// keeps its first sample as is and every column of the following samples
+// as a separate byte stream: the timestamps are delta-of-delta encoded, the
+// other columns delta encoded, both zigzag varints with runs of zeros
+// collapsed into a single token, so an image that does not change polled
+// at a fixed interval costs next to nothing
+//
+// only the last block of a series is open, the sealed ones are packed back
+// to back into a single buffer per series and indexed by their time range,
+// so the per block overhead is a few dozen bytes, and the per series one a
+// few hundred
+class history_t {
+public:
+  enum column_t {
+    COLUMN_TIMESTAMP = 0,
+    COLUMN_SIZE,
+    COLUMN_DU,
+    COLUMN_DIRTY,
+    COLUMN_SNAPS,
+    COLUMN_LAST,
+  };
+  static constexpr size_t COLUMNS = COLUMN_LAST;
+  static constexpr uint32_t BLOCK_SAMPLES = 4096;
+
+  using sample_t = std::array<int64_t, COLUMNS>;
+
+  static sample_t make_sample(int64_t timestamp, const librbdx::image_info_t& info) {
+    return sample_t{{timestamp,
+        static_cast<int64_t>(info.size),
+        info.du,
+        info.dirty,
+        static_cast<int64_t>(info.snaps.size())}};
+  }
+
+  // -EINVAL if `sample` is not newer than the last sample of the series
+  int append(const std::string& image_id, const sample_t& sample) {
+    auto& s = series[image_id];
+    if (s.open.count != 0 && sample[COLUMN_TIMESTAMP] <= s.last[COLUMN_TIMESTAMP]) {
+      return -EINVAL;
+    }
+    if (s.open.count == BLOCK_SAMPLES) {
+      s.seal();
+    }
+    if (s.open.count == 0) {
+      s.open.first = sample;
+      s.open.count = 1;
+      s.last = sample;
+      s.last_delta = 0;
+      num_samples++;
+      return 0;
+    }
+
+    auto& b = s.open;
+    int64_t delta = sub(sample[COLUMN_TIMESTAMP], s.last[COLUMN_TIMESTAMP]);
+    b.columns[COLUMN_TIMESTAMP].put(sub(delta, s.last_delta));
+    for (size_t i = COLUMN_TIMESTAMP + 1; i < COLUMNS; i++) {
+      b.columns[i].put(sub(sample[i], s.last[i]));
+    }
+    b.count++;
+    s.last = sample;
+    s.last_delta = delta;
+    num_samples++;
+    return 0;
+  }
+
+  // the images that failed are skipped, so are the images that already
+  // have a sample not older than `timestamp`, returns the number of samples
+  // appended
+  uint64_t append(int64_t timestamp,
+      const std::map<std::string, std::pair<librbdx::image_info_t, int>>& infos) {
+    uint64_t n = 0;
+    for (auto& it : infos) {
+      if (it.second.second < 0) {
+        continue;
+      }
+      if (append(it.first, make_sample(timestamp, it.second.first)) == 0) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  void remove(const std::string& image_id) {
+    auto it = series.find(image_id);
+    if (it == series.end()) {
+      return;
+    }
+    for (auto& b : it->second.blocks) {
+      num_samples -= b.count;
+    }
+    num_samples -= it->second.open.count;
+    series.erase(it);
+  }
+
+  // samples in [`start`, `end`], if `step` is positive only the last sample
+  // of every `step` wide bucket (aligned to `start`) is kept
+  std::vector<sample_t> query(const std::string& image_id,
+      int64_t start, int64_t end, int64_t step = 0) const {
+    std::vector<sample_t> r;
+    auto it = series.find(image_id);
+    if (it == series.end() || start > end) {
+      return r;
+    }
+
+    query_sink_t f{start, end, step, &r};
+    auto& s = it->second;
+    for (size_t i = 0; i < s.blocks.size(); i++) {
+      auto& b = s.blocks[i];
+      if (b.last_timestamp < start) {
+        continue;
+      }
+      if (b.first_timestamp > end) {
+        return r;
+      }
+      packed_block_t pb;
+      // validated by `decode`, if it came from there
+      if (!pb.unpack(s.packed, s.block_end(i), b)) {
+        continue;
+      }
+      decode_block(pb.first, b.count, pb.columns, f);
+    }
+    if (s.open.count != 0 && s.open.first[COLUMN_TIMESTAMP] <= end &&
+        s.last[COLUMN_TIMESTAMP] >= start) {
+      std::array<std::pair<const char*, size_t>, COLUMNS> columns;
+      for (size_t i = 0; i < COLUMNS; i++) {
+        columns[i] = std::make_pair(s.open.columns[i].bytes.data(),
+            s.open.columns[i].bytes.size());
+      }
+      decode_block(s.open.first, s.open.count, columns, f);
+    }
+    return r;
+  }
+
+  size_t size() const {
+    return series.size();
+  }
+  uint64_t samples() const {
+    return num_samples;
+  }
+  // approximately, the encoded bytes plus the bookkeeping of the series,
+  // i.e., what the history costs in memory
+  uint64_t bytes() const {
+    uint64_t n = series.bucket_count() * sizeof(void*);
+    for (auto& it : series) {
+      auto& s = it.second;
+      // the hash table node, i.e., the value, next pointer and hash
+      n += sizeof(it) + 2 * sizeof(void*);
+      n += heap_bytes(it.first) + heap_bytes(s.packed);
+      n += s.blocks.capacity() * sizeof(block_index_t);
+      for (auto& c : s.open.columns) {
+        n += heap_bytes(c.bytes);
+      }
+    }
+    return n;
+  }
+
+  std::vector<std::string> image_ids() const {
+    std::vector<std::string> r;
+    r.reserve(series.size());
+    for (auto& it : series) {
+      r.push_back(it.first);
+    }
+    return r;
+  }
+
+  // writes a history file, see history_file_t, to a temporary file renamed
+  // over `path` once it is synced, so `path` is either the old or the new
+  // history
+  int save(const std::string& path) const;
+  // replaces the history with the one in the history file `path`, left
+  // alone on errors, which are those of history_file_t::open
+  int load(const std::string& path);
+
+private:
+  // in uint64_t, the values are arbitrary so their difference may not fit
+  // in int64_t, the wrapped result gets back the exact value on `add`
+  static int64_t sub(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+  }
+  static int64_t add(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+  }
+
+  // short strings are stored inline
+  static uint64_t heap_bytes(const std::string& s) {
+    return (s.capacity() < sizeof(std::string)) ? 0 : s.capacity() + 1;
+  }
+
+  // keeps the samples in [`start`, `end`], only the last one of every
+  // `step` wide bucket if `step` is positive
+  struct query_sink_t {
+    int64_t start;
+    int64_t end;
+    int64_t step;
+    std::vector<sample_t>* r;
+
+    void operator()(const sample_t& sample) {
+      int64_t ts = sample[COLUMN_TIMESTAMP];
+      if (ts < start || ts > end) {
+        return;
+      }
+      if (step > 0 && !r->empty() &&
+          bucket(r->back()[COLUMN_TIMESTAMP]) == bucket(ts)) {
+        r->back() = sample;
+        return;
+      }
+      r->push_back(sample);
+    }
+
+    // unsigned, `start` may be as small as INT64_MIN
+    uint64_t bucket(int64_t t) const {
+      return (static_cast<uint64_t>(t) - static_cast<uint64_t>(start)) /
+          static_cast<uint64_t>(step);
+    }
+  };
+
+  // token is a varint, (n << 1) | 1 for a run of n zeros, (zigzag << 1) for a
+  // non-zero value, 0 escapes a zigzag value too large to be shifted
+  struct column_stream_t {
+    std::string bytes;
+    uint32_t zeros = 0;     // pending run, not yet in `bytes`
+
+    void put(int64_t v) {
+      if (v == 0) {
+        zeros++;
+        return;
+      }
+      flush();
+      encoder_t e(&bytes);
+      uint64_t zz = (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+      if (zz >> 63) {
+        e.put_varint(0);
+        e.put_varint(zz);
+      } else {
+        e.put_varint(zz << 1);
+      }
+    }
+    void flush() {
+      if (zeros) {
+        encoder_t e(&bytes);
+        e.put_varint((static_cast<uint64_t>(zeros) << 1) | 1);
+        zeros = 0;
+      }
+    }
+  };
+
+  class column_reader_t {
+  public:
+    column_reader_t(const char* p, size_t len)
+      : d(p, len) {}
+
+    int64_t next() {
+      if (run) {
+        run--;
+        return 0;
+      }
+      uint64_t t;
+      if (!d.get_varint(&t)) {
+        // the pending run of the open block
+        return 0;
+      }
+      uint64_t zz;
+      if (t & 1) {
+        run = (t >> 1) - 1;
+        return 0;
+      } else if (t == 0) {
+        if (!d.get_varint(&zz)) {
+          return 0;
+        }
+      } else {
+        zz = t >> 1;
+      }
+      return static_cast<int64_t>(zz >> 1) ^ -static_cast<int64_t>(zz & 1);
+    }
+
+  private:
+    decoder_t d;
+    uint64_t run = 0;
+  };
+
+  template <typename F>
+  static void decode_block(const sample_t& first, uint32_t count,
+      const std::array<std::pair<const char*, size_t>, COLUMNS>& columns,
+      F&& f) {
+    std::array<column_reader_t, COLUMNS> readers{{
+      column_reader_t(columns[0].first, columns[0].second),
+      column_reader_t(columns[1].first, columns[1].second),
+      column_reader_t(columns[2].first, columns[2].second),
+      column_reader_t(columns[3].first, columns[3].second),
+      column_reader_t(columns[4].first, columns[4].second),
+    }};
+    sample_t s = first;
+    int64_t delta = 0;
+    f(s);
+    for (uint32_t n = 1; n < count; n++) {
+      delta = add(delta, readers[COLUMN_TIMESTAMP].next());
+      s[COLUMN_TIMESTAMP] = add(s[COLUMN_TIMESTAMP], delta);
+      for (size_t i = COLUMN_TIMESTAMP + 1; i < COLUMNS; i++) {
+        s[i] = add(s[i], readers[i].next());
+      }
+      f(s);
+    }
+  }
+
+  // a sealed block in series_t::packed, from `offset` up to the offset of
+  // the next block
+  struct block_index_t {
+    int64_t first_timestamp;
+    int64_t last_timestamp;
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  // the first sample, the length of every column, then the columns
+  struct packed_block_t {
+    sample_t first;
+    std::array<std::pair<const char*, size_t>, COLUMNS> columns;
+
+    static void pack(const sample_t& first,
+        std::array<column_stream_t, COLUMNS>& columns,
+        std::string* bl) {
+      encoder_t e(bl);
+      for (auto v : first) {
+        e.put_svarint(v);
+      }
+      for (auto& c : columns) {
+        c.flush();
+        e.put_varint(c.bytes.size());
+      }
+      for (auto& c : columns) {
+        bl->append(c.bytes);
+      }
+    }
+
+    bool unpack(const std::string& packed, size_t end, const block_index_t& b) {
+      if (b.offset > end || end > packed.size()) {
+        return false;
+      }
+      decoder_t d(packed.data() + b.offset, end - b.offset);
+      for (auto& v : first) {
+        if (!d.get_svarint(&v)) {
+          return false;
+        }
+      }
+      std::array<uint64_t, COLUMNS> lens;
+      for (auto& len : lens) {
+        if (!d.get_varint(&len)) {
+          return false;
+        }
+      }
+      for (size_t i = 0; i < COLUMNS; i++) {
+        if (!d.get_raw(&columns[i].first, lens[i])) {
+          return false;
+        }
+        columns[i].second = lens[i];
+      }
+      return d.empty() && first[COLUMN_TIMESTAMP] == b.first_timestamp;
+    }
+  };
+
+  struct open_block_t {
+    sample_t first;
+    uint32_t count = 0;
+    std::array<column_stream_t, COLUMNS> columns;
+  };
+
+  struct series_t {
+    std::string packed;
+    std::vector<block_index_t> blocks;
+    open_block_t open;
+    sample_t last;
+    int64_t last_delta = 0;
+
+    size_t block_end(size_t i) const {
+      return (i + 1 < blocks.size()) ? blocks[i + 1].offset : packed.size();
+    }
+
+    void seal() {
+      block_index_t b{open.first[COLUMN_TIMESTAMP], last[COLUMN_TIMESTAMP],
+          static_cast<uint32_t>(packed.size()), open.count};
+      packed_block_t::pack(open.first, open.columns, &packed);
+      packed.shrink_to_fit();
+      blocks.push_back(b);
+      blocks.shrink_to_fit();
+      open = open_block_t{};
+    }
+  };
+
+  friend class history_file_t;
+  friend void encode(const history_t& o, encoder_t* e);
+  friend bool decode(history_t* o, decoder_t* d);
+
+  std::unordered_map<std::string, series_t> series;
+  uint64_t num_samples = 0;
+};
+
+static_assert(history_t::COLUMNS == 5, "update history_t::decode_block");
+
+// a history saved by history_t::save, of which `open` reads the directory
+// only, i.e., the image ids and the time range and file offset of their
+// blocks, so a query reads the blocks that overlap its range and nothing
+// else
+//
+// the file is the magic, the blocks of every series back to back with the
+// open block packed last, the directory as a versioned blob, then a
+// trailer of the offset and length of the directory (u64, little endian)
+// and the magic again, written last so a torn file is rejected
+class history_file_t {
+public:
+  using sample_t = history_t::sample_t;
+
+  history_file_t() = default;
+  ~history_file_t() {
+    close();
+  }
+
+  history_file_t(const history_file_t&) = delete;
+  history_file_t& operator=(const history_file_t&) = delete;
+
+  // -EINVAL if `path` is not a history file, -EOPNOTSUPP if it was written
+  // by a newer and incompatible version, -errno otherwise
+  int open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -errno;
+    }
+    this->fd = fd;
+    int r = read_directory();
+    if (r < 0) {
+      close();
+    }
+    return r;
+  }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    series.clear();
+    num_samples = 0;
+  }
+
+  size_t size() const {
+    return series.size();
+  }
+  uint64_t samples() const {
+    return num_samples;
+  }
+
+  std::vector<std::string> image_ids() const {
+    std::vector<std::string> r;
+    r.reserve(series.size());
+    for (auto& it : series) {
+      r.push_back(it.first);
+    }
+    return r;
+  }
+
+  // same as history_t::query, the blocks are read with a single pread,
+  // -EINVAL if they are malformed
+  int query(const std::string& image_id, int64_t start, int64_t end,
+      int64_t step, std::vector<sample_t>* r) const {
+    r->clear();
+    auto it = series.find(image_id);
+    if (it == series.end() || start > end) {
+      return 0;
+    }
+
+    // the blocks are in time order, the ones in range are contiguous
+    auto& s = it->second;
+    size_t first = 0;
+    while (first < s.blocks.size() && s.blocks[first].last_timestamp < start) {
+      first++;
+    }
+    size_t last = first;
+    while (last < s.blocks.size() && s.blocks[last].first_timestamp <= end) {
+      last++;
+    }
+    if (first == last) {
+      return 0;
+    }
+
+    uint64_t base = s.blocks[first].offset;
+    std::string bl;
+    int ret = read_at(s.offset + base, s.block_end(last - 1) - base, &bl);
+    if (ret < 0) {
+      return ret;
+    }
+    history_t::query_sink_t f{start, end, step, r};
+    for (size_t i = first; i < last; i++) {
+      auto b = s.blocks[i];
+      b.offset -= base;
+      history_t::packed_block_t pb;
+      if (!pb.unpack(bl, s.block_end(i) - base, b)) {
+        r->clear();
+        return -EINVAL;
+      }
+      history_t::decode_block(pb.first, b.count, pb.columns, f);
+    }
+    return 0;
+  }
+
+private:
+  friend class history_t;
+
+  static constexpr size_t MAGIC_LEN = 8;
+  static constexpr size_t TRAILER_LEN = 16 + MAGIC_LEN;
+
+  static const char* magic() {
+    return "RBDXHIST";
+  }
+
+  // the blocks of a series, at [`offset`, `offset` + `length`) in the file,
+  // the offsets of the blocks are relative to `offset` and the last block
+  // is the open one
+  struct series_index_t {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::vector<history_t::block_index_t> blocks;
+    sample_t last;
+    int64_t last_delta = 0;
+
+    uint64_t block_end(size_t i) const {
+      return (i + 1 < blocks.size()) ? blocks[i + 1].offset : length;
+    }
+  };
+
+  static void put_u64(uint64_t v, std::string* bl) {
+    for (int i = 0; i < 8; i++) {
+      bl->push_back(static_cast<char>(v >> (8 * i)));
+    }
+  }
+  static uint64_t get_u64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+      v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return v;
+  }
+
+  static int write_all(int fd, const std::string& bl, uint64_t off) {
+    size_t done = 0;
+    while (done < bl.size()) {
+      ssize_t n = ::pwrite(fd, bl.data() + done, bl.size() - done, off + done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -errno;
+      }
+      done += n;
+    }
+    return 0;
+  }
+
+  // -EINVAL if the file ends before `len` bytes
+  int read_at(uint64_t off, uint64_t len, std::string* bl) const {
+    bl->resize(len);
+    size_t done = 0;
+    while (done < len) {
+      ssize_t n = ::pread(fd, &(*bl)[done], len - done, off + done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -errno;
+      }
+      if (n == 0) {
+        return -EINVAL;
+      }
+      done += n;
+    }
+    return 0;
+  }
+
+  int read_directory() {
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      return -errno;
+    }
+    uint64_t size = st.st_size;
+    if (size < MAGIC_LEN + TRAILER_LEN) {
+      return -EINVAL;
+    }
+    std::string head, trailer;
+    int r = read_at(0, MAGIC_LEN, &head);
+    if (r < 0) {
+      return r;
+    }
+    r = read_at(size - TRAILER_LEN, TRAILER_LEN, &trailer);
+    if (r < 0) {
+      return r;
+    }
+    if (head.compare(0, MAGIC_LEN, magic()) != 0 ||
+        trailer.compare(16, MAGIC_LEN, magic()) != 0) {
+      return -EINVAL;
+    }
+    uint64_t dir_offset = get_u64(trailer.data());
+    uint64_t dir_length = get_u64(trailer.data() + 8);
+    uint64_t dir_end = size - TRAILER_LEN;
+    if (dir_offset < MAGIC_LEN || dir_offset > dir_end ||
+        dir_length != dir_end - dir_offset) {
+      return -EINVAL;
+    }
+
+    std::string dir;
+    r = read_at(dir_offset, dir_length, &dir);
+    if (r < 0) {
+      return r;
+    }
+    decoder_t d(dir.data(), dir.size());
+    uint8_t v, compat_v;
+    if (!d.get_u8(&v) || !d.get_u8(&compat_v)) {
+      return -EINVAL;
+    }
+    if (compat_v > ENCODING_V) {
+      return -EOPNOTSUPP;
+    }
+    uint64_t n;
+    if (!d.get_length(&n)) {
+      return -EINVAL;
+    }
+    while (n--) {
+      std::string image_id;
+      series_index_t s;
+      uint64_t num_blocks;
+      if (!d.get_bytes(&image_id) || series.count(image_id) ||
+          !d.get_varint(&s.offset) || !d.get_varint(&s.length) ||
+          s.offset < MAGIC_LEN || s.offset > dir_offset ||
+          s.length > dir_offset - s.offset || s.length > UINT32_MAX ||
+          !d.get_length(&num_blocks) || num_blocks == 0) {
+        return -EINVAL;
+      }
+      s.blocks.resize(num_blocks);
+      for (size_t i = 0; i < s.blocks.size(); i++) {
+        auto& b = s.blocks[i];
+        uint64_t offset, count;
+        if (!d.get_svarint(&b.first_timestamp) ||
+            !d.get_svarint(&b.last_timestamp) ||
+            !d.get_varint(&offset) || !d.get_varint(&count) ||
+            count == 0 || count > history_t::BLOCK_SAMPLES ||
+            offset >= s.length ||
+            b.first_timestamp > b.last_timestamp) {
+          return -EINVAL;
+        }
+        // back to back from the start of the series
+        if ((i == 0) ? offset != 0 : offset <= s.blocks[i - 1].offset) {
+          return -EINVAL;
+        }
+        b.offset = static_cast<uint32_t>(offset);
+        b.count = static_cast<uint32_t>(count);
+        num_samples += b.count;
+      }
+      for (auto& v : s.last) {
+        if (!d.get_svarint(&v)) {
+          return -EINVAL;
+        }
+      }
+      if (!d.get_svarint(&s.last_delta) ||
+          s.last[history_t::COLUMN_TIMESTAMP] != s.blocks.back().last_timestamp) {
+        return -EINVAL;
+      }
+      series.emplace(std::move(image_id), std::move(s));
+    }
+    // newer compatible versions may have appended data, ignore it
+    if (v == ENCODING_V && !d.empty()) {
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  int fd = -1;
+  std::map<std::string, series_index_t> series;
+  uint64_t num_samples = 0;
+};
+
+inline int history_t::save(const std::string& path) const {
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  // sorted, so saving the same history gives the same file
+  std::vector<const std::pair<const std::string, series_t>*> sorted;
+  sorted.reserve(series.size());
+  for (auto& it : series) {
+    sorted.push_back(&it);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+      [](const std::pair<const std::string, series_t>* a,
+          const std::pair<const std::string, series_t>* b) {
+        return a->first < b->first;
+      });
+
+  std::string dir;
+  encoder_t e(&dir);
+  e.put_u8(ENCODING_V);
+  e.put_u8(ENCODING_COMPAT_V);
+  e.put_varint(sorted.size());
+
+  uint64_t off = history_file_t::MAGIC_LEN;
+  int r = history_file_t::write_all(fd,
+      std::string(history_file_t::magic(), history_file_t::MAGIC_LEN), 0);
+  for (size_t i = 0; r == 0 && i < sorted.size(); i++) {
+    auto& s = sorted[i]->second;
+    // the open block is packed as if it was sealed, from a copy since
+    // packing flushes the pending runs of zeros
+    std::string bl;
+    auto columns = s.open.columns;
+    packed_block_t::pack(s.open.first, columns, &bl);
+    r = history_file_t::write_all(fd, s.packed, off);
+    if (r == 0) {
+      r = history_file_t::write_all(fd, bl, off + s.packed.size());
+    }
+
+    encode(sorted[i]->first, &e);
+    e.put_varint(off);
+    e.put_varint(s.packed.size() + bl.size());
+    e.put_varint(s.blocks.size() + 1);
+    for (auto& b : s.blocks) {
+      e.put_svarint(b.first_timestamp);
+      e.put_svarint(b.last_timestamp);
+      e.put_varint(b.offset);
+      e.put_varint(b.count);
+    }
+    e.put_svarint(s.open.first[COLUMN_TIMESTAMP]);
+    e.put_svarint(s.last[COLUMN_TIMESTAMP]);
+    e.put_varint(s.packed.size());
+    e.put_varint(s.open.count);
+    for (auto v : s.last) {
+      e.put_svarint(v);
+    }
+    e.put_svarint(s.last_delta);
+    off += s.packed.size() + bl.size();
+  }
+  if (r == 0) {
+    uint64_t dir_length = dir.size();
+    history_file_t::put_u64(off, &dir);
+    history_file_t::put_u64(dir_length, &dir);
+    dir.append(history_file_t::magic(), history_file_t::MAGIC_LEN);
+    r = history_file_t::write_all(fd, dir, off);
+  }
+  if (r == 0 && ::fsync(fd) < 0) {
+    r = -errno;
+  }
+  if (::close(fd) < 0 && r == 0) {
+    r = -errno;
+  }
+  if (r == 0 && ::rename(tmp.c_str(), path.c_str()) < 0) {
+    r = -errno;
+  }
+  if (r < 0) {
+    ::unlink(tmp.c_str());
+  }
+  return r;
+}
+
+inline int history_t::load(const std::string& path) {
+  history_file_t f;
+  int r = f.open(path);
+  if (r < 0) {
+    return r;
+  }
+  std::unordered_map<std::string, series_t> loaded;
+  loaded.reserve(f.series.size());
+  for (auto& it : f.series) {
+    auto& si = it.second;
+    std::string bl;
+    r = f.read_at(si.offset, si.length, &bl);
+    if (r < 0) {
+      return r;
+    }
+    series_t s;
+    for (size_t i = 0; i < si.blocks.size(); i++) {
+      packed_block_t pb;
+      if (!pb.unpack(bl, si.block_end(i), si.blocks[i])) {
+        return -EINVAL;
+      }
+      if (i + 1 == si.blocks.size()) {
+        // back to an open block, with no pending run of zeros
+        s.open.first = pb.first;
+        s.open.count = si.blocks[i].count;
+        for (size_t c = 0; c < COLUMNS; c++) {
+          s.open.columns[c].bytes.assign(pb.columns[c].first,
+              pb.columns[c].second);
+        }
+      }
+    }
+    s.blocks.assign(si.blocks.begin(), si.blocks.end() - 1);
+    bl.resize(si.blocks.back().offset);
+    bl.shrink_to_fit();
+    s.packed = std::move(bl);
+    s.last = si.last;
+    s.last_delta = si.last_delta;
+    loaded.emplace(it.first, std::move(s));
+  }
+  series.swap(loaded);
+  num_samples = f.num_samples;
+  return 0;
+}
+
+inline void encode(const history_t& o, encoder_t* e) {
+  e->put_varint(o.series.size());
+  for (auto& it : o.series) {
+    encode(it.first, e);
+    auto& s = it.second;
+    e->put_bytes(s.packed.data(), s.packed.size());
+    e->put_varint(s.blocks.size());
+    for (auto& b : s.blocks) {
+      e->put_svarint(b.first_timestamp);
+      e->put_svarint(b.last_timestamp);
+      e->put_varint(b.offset);
+      e->put_varint(b.count);
+    }
+    e->put_varint(s.open.count);
+    for (auto v : s.open.first) {
+      e->put_svarint(v);
+    }
+    for (auto& c : s.open.columns) {
+      e->put_bytes(c.bytes.data(), c.bytes.size());
+      e->put_varint(c.zeros);
+    }
+    for (auto v : s.last) {
+      e->put_svarint(v);
+    }
+    e->put_svarint(s.last_delta);
+  }
+}
+
+inline bool decode(history_t* o, decoder_t* d) {
+  uint64_t n;
+  if (!d->get_length(&n)) {
+    return false;
+  }
+  o->series.clear();
+  o->num_samples = 0;
+  while (n--) {
+    std::string image_id;
+    history_t::series_t s;
+    uint64_t num_blocks;
+    // a repeated id would replace the series it was decoded to, whose
+    // samples were already counted
+    if (!d->get_bytes(&image_id) || o->series.count(image_id) ||
+        !d->get_bytes(&s.packed) || !d->get_length(&num_blocks)) {
+      return false;
+    }
+    s.blocks.resize(num_blocks);
+    for (size_t i = 0; i < s.blocks.size(); i++) {
+      auto& b = s.blocks[i];
+      uint64_t offset, count;
+      if (!d->get_svarint(&b.first_timestamp) ||
+          !d->get_svarint(&b.last_timestamp) ||
+          !d->get_varint(&offset) || !d->get_varint(&count) ||
+          count == 0 || count > history_t::BLOCK_SAMPLES ||
+          offset > s.packed.size()) {
+        return false;
+      }
+      // back to back from the start of the buffer
+      if ((i == 0) ? offset != 0 : offset <= s.blocks[i - 1].offset) {
+        return false;
+      }
+      b.offset = static_cast<uint32_t>(offset);
+      b.count = static_cast<uint32_t>(count);
+      o->num_samples += b.count;
+    }
+    for (size_t i = 0; i < s.blocks.size(); i++) {
+      history_t::packed_block_t pb;
+      if (!pb.unpack(s.packed, s.block_end(i), s.blocks[i])) {
+        return false;
+      }
+    }
+    uint64_t count;
+    // the open block always has a sample, a new one is started on sealing
+    if (!d->get_varint(&count) || count == 0 ||
+        count > history_t::BLOCK_SAMPLES) {
+      return false;
+    }
+    s.open.count = static_cast<uint32_t>(count);
+    for (auto& v : s.open.first) {
+      if (!d->get_svarint(&v)) {
+        return false;
+      }
+    }
+    for (auto& c : s.open.columns) {
+      uint64_t zeros;
+      if (!d->get_bytes(&c.bytes) || !d->get_varint(&zeros) ||
+          zeros >= history_t::BLOCK_SAMPLES) {
+        return false;
+      }
+      c.zeros = static_cast<uint32_t>(zeros);
+    }
+    for (auto& v : s.last) {
+      if (!d->get_svarint(&v)) {
+        return false;
+      }
+    }
+    if (!d->get_svarint(&s.last_delta)) {
+      return false;
+    }
+    o->num_samples += s.open.count;
+    o->series[image_id] = std::move(s);
+  }
+  return true;
+}
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_HISTORY_H_ */
@@ -0,0 +1,107 @@
+/*
+ * id_cache.h
+ */
+
+#ifndef SRC_RBDX_ID_CACHE_H_
+#define SRC_RBDX_ID_CACHE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+namespace rbdx {
+
+// image name -> id, per <cluster fsid, pool id, namespace>
+//
+// entries expire after `ttl`, a full listing replaces all the entries of
+// the pool, callers invalidate an entry whose image is gone. entries are
+// trusted otherwise, so a renamed image is found by its old name for up to
+// `ttl`, unless a listing comes first
+class id_cache_t {
+public:
+  using clock = std::chrono::steady_clock;
+  using pool_t = std::tuple<std::string, int64_t, std::string>;
+
+  void set_ttl(clock::duration ttl) {
+    std::lock_guard<std::mutex> l(lock);
+    this->ttl = ttl;
+  }
+  clock::duration get_ttl() {
+    std::lock_guard<std::mutex> l(lock);
+    return ttl;
+  }
+
+  bool get(const pool_t& pool, const std::string& name, std::string* id) {
+    std::lock_guard<std::mutex> l(lock);
+    auto pit = pools.find(pool);
+    if (pit == pools.end()) {
+      return false;
+    }
+    auto it = pit->second.find(name);
+    if (it == pit->second.end()) {
+      return false;
+    }
+    if (clock::now() - it->second.stamp > ttl) {
+      pit->second.erase(it);
+      return false;
+    }
+    *id = it->second.id;
+    return true;
+  }
+
+  void put(const pool_t& pool, const std::string& name, const std::string& id) {
+    std::lock_guard<std::mutex> l(lock);
+    pools[pool][name] = entry_t{id, clock::now()};
+  }
+
+  // `images` is <id, name> as returned by librbdx::list, if `complete` is
+  // true it is the whole pool and replaces what we have
+  void put(const pool_t& pool, const std::map<std::string, std::string>& images,
+      bool complete) {
+    auto now = clock::now();
+    std::lock_guard<std::mutex> l(lock);
+    auto& names = pools[pool];
+    if (complete) {
+      names.clear();
+      names.reserve(images.size());
+    }
+    for (auto& it : images) {
+      names[it.second] = entry_t{it.first, now};
+    }
+  }
+
+  void invalidate(const pool_t& pool, const std::string& name) {
+    std::lock_guard<std::mutex> l(lock);
+    auto pit = pools.find(pool);
+    if (pit != pools.end()) {
+      pit->second.erase(name);
+    }
+  }
+
+  void clear(const pool_t& pool) {
+    std::lock_guard<std::mutex> l(lock);
+    pools.erase(pool);
+  }
+  void clear() {
+    std::lock_guard<std::mutex> l(lock);
+    pools.clear();
+  }
+
+private:
+  struct entry_t {
+    std::string id;
+    clock::time_point stamp;
+  };
+
+  std::mutex lock;
+  std::map<pool_t, std::unordered_map<std::string, entry_t>> pools;
+  clock::duration ttl = std::chrono::seconds(60);
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_ID_CACHE_H_ */
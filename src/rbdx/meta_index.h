@@ -0,0 +1,276 @@
+/*
+ * meta_index.h
+ */
+
+#ifndef SRC_RBDX_META_INDEX_H_
+#define SRC_RBDX_META_INDEX_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+
+namespace rbdx {
+
+// a metadata key, or a key = value pair if `has_value`, taken apart so
+// keys and values may contain any character, '=' included
+struct meta_term_t {
+  std::string key;
+  std::string value;
+  bool has_value = false;
+};
+
+// inverted index of image_info_t::metas, maps both keys and key = value
+// pairs to the set of image ids that have them
+//
+// image ids are interned to ordinals, so a posting list is a sorted vector
+// of uint32_t and AND/OR are linear merges
+class meta_index_t {
+public:
+  using posting_t = std::vector<uint32_t>;
+
+  size_t size() const {
+    return ordinals.size();
+  }
+
+  void clear() {
+    keys.clear();
+    ordinals.clear();
+    ids.clear();
+    metas.clear();
+    free_ordinals.clear();
+  }
+
+  // replace the index with `infos`, the images not in it are dropped
+  void build(const std::map<std::string, std::pair<librbdx::image_info_t, int>>& infos) {
+    clear();
+    for (auto& it : infos) {
+      if (it.second.second < 0) {
+        continue;
+      }
+      update(it.second.first);
+    }
+  }
+
+  // replace whatever was indexed for `info.id`
+  void update(const librbdx::image_info_t& info) {
+    uint32_t ord;
+    auto it = ordinals.find(info.id);
+    if (it != ordinals.end()) {
+      ord = it->second;
+      if (metas[ord] == info.metas) {
+        return;
+      }
+      unindex(ord);
+    } else {
+      ord = intern(info.id);
+    }
+    metas[ord] = info.metas;
+    for (auto& m : metas[ord]) {
+      auto& k = keys[m.first];
+      insert(&k.images, ord);
+      insert(&k.values[m.second], ord);
+    }
+  }
+
+  void remove(const std::string& image_id) {
+    auto it = ordinals.find(image_id);
+    if (it == ordinals.end()) {
+      return;
+    }
+    uint32_t ord = it->second;
+    unindex(ord);
+    metas[ord].clear();
+    ids[ord].clear();
+    ordinals.erase(it);
+    free_ordinals.push_back(ord);
+  }
+
+  posting_t find(const meta_term_t& term) const {
+    return find(term.key, term.has_value ? &term.value : nullptr);
+  }
+
+  posting_t find(const std::string& key, const std::string* value) const {
+    auto it = keys.find(key);
+    if (it == keys.end()) {
+      return {};
+    }
+    if (value == nullptr) {
+      return it->second.images;
+    }
+    auto vit = it->second.values.find(*value);
+    if (vit == it->second.values.end()) {
+      return {};
+    }
+    return vit->second;
+  }
+
+  // images having any key that starts with `prefix`
+  posting_t find_prefix(const std::string& prefix) const {
+    std::vector<const posting_t*> postings;
+    for (auto it = keys.lower_bound(prefix);
+        it != keys.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+        ++it) {
+      postings.push_back(&it->second.images);
+    }
+    return unite(postings);
+  }
+
+  posting_t find_all(const std::vector<meta_term_t>& terms) const {
+    if (terms.empty()) {
+      return {};
+    }
+    std::vector<posting_t> postings;
+    postings.reserve(terms.size());
+    for (auto& t : terms) {
+      postings.push_back(find(t));
+      if (postings.back().empty()) {
+        return {};
+      }
+    }
+    // smallest first, so the intermediate results only shrink
+    std::sort(postings.begin(), postings.end(),
+        [](const posting_t& a, const posting_t& b) {
+          return a.size() < b.size();
+        });
+    posting_t r = std::move(postings[0]);
+    for (size_t i = 1; i < postings.size() && !r.empty(); i++) {
+      r = intersect(r, postings[i]);
+    }
+    return r;
+  }
+
+  posting_t find_any(const std::vector<meta_term_t>& terms) const {
+    std::vector<posting_t> found;
+    found.reserve(terms.size());
+    std::vector<const posting_t*> postings;
+    postings.reserve(terms.size());
+    for (auto& t : terms) {
+      found.push_back(find(t));
+      postings.push_back(&found.back());
+    }
+    return unite(postings);
+  }
+
+  std::vector<std::string> to_ids(const posting_t& p) const {
+    std::vector<std::string> r;
+    r.reserve(p.size());
+    for (auto ord : p) {
+      r.push_back(ids[ord]);
+    }
+    return r;
+  }
+
+  static posting_t intersect(const posting_t& a, const posting_t& b) {
+    posting_t r;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+        std::back_inserter(r));
+    return r;
+  }
+
+  static posting_t unite(const posting_t& a, const posting_t& b) {
+    posting_t r;
+    r.reserve(a.size() + b.size());
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+        std::back_inserter(r));
+    return r;
+  }
+
+  // concatenated and sorted once, rather than merged pairwise, which is
+  // quadratic in the number of postings
+  static posting_t unite(const std::vector<const posting_t*>& postings) {
+    if (postings.size() == 1) {
+      return *postings[0];
+    }
+    size_t n = 0;
+    for (auto* p : postings) {
+      n += p->size();
+    }
+    posting_t r;
+    r.reserve(n);
+    for (auto* p : postings) {
+      r.insert(r.end(), p->begin(), p->end());
+    }
+    std::sort(r.begin(), r.end());
+    r.erase(std::unique(r.begin(), r.end()), r.end());
+    return r;
+  }
+
+private:
+  struct key_entry_t {
+    posting_t images;
+    std::unordered_map<std::string, posting_t> values;
+  };
+
+  uint32_t intern(const std::string& image_id) {
+    uint32_t ord;
+    if (!free_ordinals.empty()) {
+      ord = free_ordinals.back();
+      free_ordinals.pop_back();
+      ids[ord] = image_id;
+    } else {
+      ord = static_cast<uint32_t>(ids.size());
+      ids.push_back(image_id);
+      metas.emplace_back();
+    }
+    ordinals[image_id] = ord;
+    return ord;
+  }
+
+  void unindex(uint32_t ord) {
+    for (auto& m : metas[ord]) {
+      auto kit = keys.find(m.first);
+      if (kit == keys.end()) {
+        continue;
+      }
+      auto& k = kit->second;
+      auto vit = k.values.find(m.second);
+      if (vit != k.values.end()) {
+        erase(&vit->second, ord);
+        if (vit->second.empty()) {
+          k.values.erase(vit);
+        }
+      }
+      erase(&k.images, ord);
+      if (k.images.empty()) {
+        keys.erase(kit);
+      }
+    }
+  }
+
+  // ordinals are mostly handed out in increasing order, so this is mostly
+  // an append
+  static void insert(posting_t* p, uint32_t ord) {
+    if (p->empty() || p->back() < ord) {
+      p->push_back(ord);
+      return;
+    }
+    auto it = std::lower_bound(p->begin(), p->end(), ord);
+    if (it == p->end() || *it != ord) {
+      p->insert(it, ord);
+    }
+  }
+
+  static void erase(posting_t* p, uint32_t ord) {
+    auto it = std::lower_bound(p->begin(), p->end(), ord);
+    if (it != p->end() && *it == ord) {
+      p->erase(it);
+    }
+  }
+
+  std::map<std::string, key_entry_t> keys;    // ordered for prefix queries
+  std::unordered_map<std::string, uint32_t> ordinals;
+  std::vector<std::string> ids;               // indexed by ordinal
+  std::vector<std::map<std::string, std::string>> metas;
+  std::vector<uint32_t> free_ordinals;
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_META_INDEX_H_ */
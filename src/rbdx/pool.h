@@ -0,0 +1,46 @@
+/*
+ * pool.h
+ */
+
+#ifndef SRC_RBDX_POOL_H_
+#define SRC_RBDX_POOL_H_
+
+#include <cstdint>
+#include <string>
+
+#include "../rbd/librbdx.hpp"
+
+namespace rbdx {
+
+enum class image_state_t : uint32_t {
+  IMAGE_STATE_LIVE  = 0,
+  IMAGE_STATE_TRASH = 1
+};
+
+inline std::string stringify(const image_state_t& o) {
+  switch (o) {
+  case image_state_t::IMAGE_STATE_LIVE:
+    return "live";
+  case image_state_t::IMAGE_STATE_TRASH:
+    return "trash";
+  default:
+    return "unknown";
+  }
+}
+
+// where an image of a pool-wide listing was found
+struct image_source_t {
+  std::string pool_namespace;
+  image_state_t state;
+  int64_t deletion_timestamp;       // trash only
+  int64_t deferment_end_timestamp;  // trash only, can not be purged before
+};
+
+struct pool_image_info_t {
+  image_source_t source;
+  librbdx::image_info_t info;
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_POOL_H_ */
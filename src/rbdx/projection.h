@@ -0,0 +1,451 @@
+/*
+ * projection.h
+ */
+
+#ifndef SRC_RBDX_PROJECTION_H_
+#define SRC_RBDX_PROJECTION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+#include "scan.h"
+
+namespace rbdx {
+
+// fields of image_info_t, for scans that need only some of them, `id` is
+// always filled
+enum class field_t : uint64_t {
+  FIELD_NAME          = 1ULL << 0,
+  FIELD_ORDER         = 1ULL << 1,
+  FIELD_SIZE          = 1ULL << 2,
+  FIELD_FEATURES      = 1ULL << 3,  // features and op_features
+  FIELD_FLAGS         = 1ULL << 4,
+  FIELD_SNAPS         = 1ULL << 5,  // w/o children and du, see info_filter_t
+  FIELD_PARENT        = 1ULL << 6,
+  FIELD_TIMESTAMPS    = 1ULL << 7,  // create, access and modify
+  FIELD_DATA_POOL     = 1ULL << 8,
+  FIELD_WATCHERS      = 1ULL << 9,
+  FIELD_METAS         = 1ULL << 10,
+  FIELD_DU            = 1ULL << 11, // du and dirty, same as INFO_F_IMAGE_DU
+  FIELD_ALL           = (1ULL << 12) - 1
+};
+
+} // namespace rbdx
+
+namespace librbdx {
+
+template<> struct Enable<rbdx::field_t> : std::true_type { };
+
+}
+
+namespace rbdx {
+
+// so they are found by ADL
+using librbdx::operator&;
+using librbdx::operator|;
+using librbdx::operator&=;
+using librbdx::operator|=;
+
+constexpr bool has_field(field_t fields, field_t f) {
+  return static_cast<uint64_t>(fields & f) != 0;
+}
+
+// list_info filter that fills `fields`
+constexpr uint64_t info_flags(field_t fields) {
+  return has_field(fields, field_t::FIELD_DU) ?
+      static_cast<uint64_t>(librbdx::info_filter_t::INFO_F_IMAGE_DU) : 0;
+}
+
+// strings referenced by the records of a projection, appended to a single
+// buffer, not deduplicated since image ids and names are unique in a pool
+class string_table_t {
+public:
+  uint32_t add(const std::string& s) {
+    offsets.push_back(data.size());
+    data.append(s);
+    return static_cast<uint32_t>(offsets.size() - 1);
+  }
+
+  std::string get(uint32_t i) const {
+    if (i >= offsets.size()) {
+      return {};
+    }
+    uint64_t end = (i + 1 < offsets.size()) ? offsets[i + 1] : data.size();
+    return data.substr(offsets[i], end - offsets[i]);
+  }
+
+  size_t size() const {
+    return offsets.size();
+  }
+  uint64_t bytes() const {
+    return data.size() + offsets.size() * sizeof(uint64_t);
+  }
+
+private:
+  std::string data;
+  std::vector<uint64_t> offsets;
+};
+
+// a member of a record, `format` is the struct module format character
+struct member_t {
+  const char* name;
+  char format;
+  size_t offset;
+};
+
+namespace detail {
+
+template <typename T> struct format_of;
+template <> struct format_of<uint8_t> { static constexpr char value = 'B'; };
+template <> struct format_of<int32_t> { static constexpr char value = 'i'; };
+template <> struct format_of<uint32_t> { static constexpr char value = 'I'; };
+template <> struct format_of<int64_t> { static constexpr char value = 'q'; };
+template <> struct format_of<uint64_t> { static constexpr char value = 'Q'; };
+
+template <typename T>
+member_t member(const char* name, size_t offset, const T&) {
+  return member_t{name, format_of<T>::value, offset};
+}
+
+// storage of field `F` in a record of `Fields`, empty if `F` is not one of
+// `Fields`, so it costs nothing as a base
+template <field_t Fields, field_t F, bool = has_field(Fields, F)>
+struct field_storage_t {
+  void load(const std::string&, const librbdx::image_info_t&, int,
+      string_table_t*) {}
+  void describe(size_t, std::vector<member_t>*) const {}
+};
+
+// always there
+struct id_storage_t {
+  uint32_t id;      // index into the string table
+  int32_t r;
+
+  void load(const std::string& image_id, const librbdx::image_info_t&, int r,
+      string_table_t* strings) {
+    id = strings->add(image_id);
+    this->r = r;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("id", base + offsetof(id_storage_t, id), id));
+    v->push_back(member("r", base + offsetof(id_storage_t, r), r));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_NAME, true> {
+  uint32_t name;    // index into the string table
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t* strings) {
+    name = strings->add(info.name);
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("name", base + offsetof(field_storage_t, name), name));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_ORDER, true> {
+  uint8_t order;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    order = info.order;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("order", base + offsetof(field_storage_t, order), order));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_SIZE, true> {
+  uint64_t size;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    size = info.size;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("size", base + offsetof(field_storage_t, size), size));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_FEATURES, true> {
+  uint64_t features;
+  uint64_t op_features;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    features = info.features;
+    op_features = info.op_features;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("features",
+        base + offsetof(field_storage_t, features), features));
+    v->push_back(member("op_features",
+        base + offsetof(field_storage_t, op_features), op_features));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_FLAGS, true> {
+  uint64_t flags;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    flags = info.flags;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("flags", base + offsetof(field_storage_t, flags), flags));
+  }
+};
+
+// the number of snapshots only
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_SNAPS, true> {
+  uint32_t snaps;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    snaps = static_cast<uint32_t>(info.snaps.size());
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("snaps", base + offsetof(field_storage_t, snaps), snaps));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_PARENT, true> {
+  int64_t parent_pool_id;
+  uint64_t parent_snap_id;
+  uint32_t parent_namespace;    // index into the string table
+  uint32_t parent_image_id;     // index into the string table
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t* strings) {
+    parent_pool_id = info.parent.pool_id;
+    parent_snap_id = info.parent.snap_id;
+    parent_namespace = strings->add(info.parent.pool_namespace);
+    parent_image_id = strings->add(info.parent.image_id);
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("parent_pool_id",
+        base + offsetof(field_storage_t, parent_pool_id), parent_pool_id));
+    v->push_back(member("parent_snap_id",
+        base + offsetof(field_storage_t, parent_snap_id), parent_snap_id));
+    v->push_back(member("parent_namespace",
+        base + offsetof(field_storage_t, parent_namespace), parent_namespace));
+    v->push_back(member("parent_image_id",
+        base + offsetof(field_storage_t, parent_image_id), parent_image_id));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_TIMESTAMPS, true> {
+  int64_t create_timestamp;
+  int64_t access_timestamp;
+  int64_t modify_timestamp;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    create_timestamp = info.create_timestamp;
+    access_timestamp = info.access_timestamp;
+    modify_timestamp = info.modify_timestamp;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("create_timestamp",
+        base + offsetof(field_storage_t, create_timestamp), create_timestamp));
+    v->push_back(member("access_timestamp",
+        base + offsetof(field_storage_t, access_timestamp), access_timestamp));
+    v->push_back(member("modify_timestamp",
+        base + offsetof(field_storage_t, modify_timestamp), modify_timestamp));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_DATA_POOL, true> {
+  int64_t data_pool_id;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    data_pool_id = info.data_pool_id;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("data_pool_id",
+        base + offsetof(field_storage_t, data_pool_id), data_pool_id));
+  }
+};
+
+// the number of watchers only
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_WATCHERS, true> {
+  uint32_t watchers;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    watchers = static_cast<uint32_t>(info.watchers.size());
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("watchers",
+        base + offsetof(field_storage_t, watchers), watchers));
+  }
+};
+
+template <field_t Fields>
+struct field_storage_t<Fields, field_t::FIELD_DU, true> {
+  int64_t du;
+  int64_t dirty;
+
+  void load(const std::string&, const librbdx::image_info_t& info, int,
+      string_table_t*) {
+    du = info.du;
+    dirty = info.dirty;
+  }
+  void describe(size_t base, std::vector<member_t>* v) const {
+    v->push_back(member("du", base + offsetof(field_storage_t, du), du));
+    v->push_back(member("dirty", base + offsetof(field_storage_t, dirty), dirty));
+  }
+};
+
+template <field_t Fields, typename... Bases>
+struct record_base_t : Bases... {
+  void load(const std::string& image_id, const librbdx::image_info_t& info,
+      int r, string_table_t* strings) {
+    using swallow = int[];
+    (void)swallow{0, (Bases::load(image_id, info, r, strings), 0)...};
+  }
+
+  static std::vector<member_t> members() {
+    std::vector<member_t> v;
+    record_base_t o{};
+    auto p = reinterpret_cast<const char*>(&o);
+    using swallow = int[];
+    (void)swallow{0, (static_cast<const Bases&>(o).describe(
+        reinterpret_cast<const char*>(&static_cast<const Bases&>(o)) - p,
+        &v), 0)...};
+    return v;
+  }
+};
+
+}
+
+// compact record of `Fields` of an image, the bases are ordered by
+// alignment so there is little padding, e.g., record_t<FIELD_NAME |
+// FIELD_SIZE> is 24 bytes
+template <field_t Fields>
+using record_t = detail::record_base_t<Fields,
+    detail::field_storage_t<Fields, field_t::FIELD_SIZE>,
+    detail::field_storage_t<Fields, field_t::FIELD_FEATURES>,
+    detail::field_storage_t<Fields, field_t::FIELD_FLAGS>,
+    detail::field_storage_t<Fields, field_t::FIELD_PARENT>,
+    detail::field_storage_t<Fields, field_t::FIELD_TIMESTAMPS>,
+    detail::field_storage_t<Fields, field_t::FIELD_DATA_POOL>,
+    detail::field_storage_t<Fields, field_t::FIELD_DU>,
+    detail::id_storage_t,
+    detail::field_storage_t<Fields, field_t::FIELD_NAME>,
+    detail::field_storage_t<Fields, field_t::FIELD_SNAPS>,
+    detail::field_storage_t<Fields, field_t::FIELD_WATCHERS>,
+    detail::field_storage_t<Fields, field_t::FIELD_ORDER>>;
+
+// result of a scan of `Fields`, one record per image in the order they
+// were done, strings are kept aside in a single table
+template <field_t Fields>
+class projection_t {
+public:
+  static_assert(!has_field(Fields, field_t::FIELD_METAS),
+      "metas do not fit a fixed size record");
+
+  using record_type = record_t<Fields>;
+  static_assert(std::is_trivially_copyable<record_type>::value,
+      "record must be trivially copyable");
+
+  void add(const std::string& image_id, const librbdx::image_info_t& info,
+      int r) {
+    records.emplace_back();
+    records.back().load(image_id, info, r, &strings);
+  }
+
+  size_t size() const {
+    return records.size();
+  }
+  const record_type* data() const {
+    return records.data();
+  }
+  const record_type& operator[](size_t i) const {
+    return records[i];
+  }
+  std::string get_string(uint32_t i) const {
+    return strings.get(i);
+  }
+
+  // struct module format of a record, the members are named, e.g.,
+  // T{=Q:size:=I:id:=i:r:=I:name:}, which numpy takes as a structured dtype
+  static std::string format() {
+    std::string fmt = "T{";
+    size_t off = 0;
+    for (auto& m : record_type::members()) {
+      if (m.offset > off) {
+        fmt += std::to_string(m.offset - off) + "x";
+      }
+      fmt += std::string("=") + m.format + ":" + m.name + ":";
+      off = m.offset + format_size(m.format);
+    }
+    if (sizeof(record_type) > off) {
+      fmt += std::to_string(sizeof(record_type) - off) + "x";
+    }
+    fmt += "}";
+    return fmt;
+  }
+
+  // scan the pool as batches of list_info, see batch_scan_t, the images
+  // that failed have their `r` set, so do the images left out by a
+  // -ETIMEDOUT/-ECANCELED scan. only a record is kept per image, i.e., the
+  // full image_info_t of at most a few batches is held at a time
+  int scan(librados::IoCtx& ioctx,
+      const deadline_t& deadline,
+      cancel_token_t* token,
+      throttle_t* throttle) {
+    images_t images;
+    int r = librbdx::list(ioctx, &images);
+    if (r < 0) {
+      return r;
+    }
+    records.reserve(images.size());
+    batch_scan_t scan(images, SCAN_BATCH_SIZE, deadline, token, throttle);
+    return scan.run(
+        [&](const images_t& batch, infos_t* infos) {
+          return librbdx::list_info(ioctx, batch, infos, info_flags(Fields));
+        },
+        [&](const std::string& image_id, librbdx::image_info_t&& info, int r) {
+          add(image_id, info, r);
+          return 0;
+        },
+        SCAN_WORKERS);
+  }
+
+private:
+  static size_t format_size(char format) {
+    switch (format) {
+    case 'B':
+      return 1;
+    case 'i':
+    case 'I':
+      return 4;
+    default:
+      return 8;
+    }
+  }
+
+  std::vector<record_type> records;
+  string_table_t strings;
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_PROJECTION_H_ */
@@ -4,14 +4,31 @@
 #include <pybind11/operators.h>
 
 #include "../rados/librados.hpp"
+#include "../radosx/radosx.h"
+#include "../rbd/librbd.hpp"
 #include "../rbd/librbdx.hpp"
+#include "encoding.h"
+#include "history.h"
+#include "id_cache.h"
+#include "meta_index.h"
+#include "pool.h"
+#include "projection.h"
+#include "scan.h"
+#include "spill.h"
+#include "throttle.h"
 
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
 #include <list>
 #include <map>
 #include <memory>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <tuple>
 #include <type_traits>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -26,6 +43,8 @@ namespace py = pybind11;
 
 using Map_string_2_pair_image_info_t_int = std::map<std::string, std::pair<librbdx::image_info_t, int>>;
 PYBIND11_MAKE_OPAQUE(Map_string_2_pair_image_info_t_int);
+using Map_string_2_pair_pool_image_info_t_int = std::map<std::string, std::pair<rbdx::pool_image_info_t, int>>;
+PYBIND11_MAKE_OPAQUE(Map_string_2_pair_pool_image_info_t_int);
 
 namespace {
 
@@ -99,6 +118,10 @@ json json_fmt(const parent_t& o);
 json json_fmt(const child_t& o);
 json json_fmt(const snap_info_t& o);
 json json_fmt(const image_info_t& o);
+json json_fmt(const rbdx::image_source_t& o);
+json json_fmt(const rbdx::pool_image_info_t& o);
+json json_fmt(const rbdx::throttle_config_t& o);
+json json_fmt(const rbdx::throttle_state_t& o);
 
 template <typename T,
   typename std::enable_if<std::is_arithmetic<T>::value ||
@@ -214,6 +237,45 @@ json json_fmt(const image_info_t& o) {
   return std::move(j);
 }
 
+json json_fmt(const rbdx::image_source_t& o) {
+  json j = json::object({});
+  j["pool_namespace"] = json_fmt(o.pool_namespace);
+  j["state"] = json_fmt(o.state);
+  j["deletion_timestamp"] = json_fmt(o.deletion_timestamp);
+  j["deferment_end_timestamp"] = json_fmt(o.deferment_end_timestamp);
+  return std::move(j);
+}
+
+json json_fmt(const rbdx::pool_image_info_t& o) {
+  json j = json::object({});
+  j["source"] = json_fmt(o.source);
+  j["info"] = json_fmt(o.info);
+  return std::move(j);
+}
+
+json json_fmt(const rbdx::throttle_config_t& o) {
+  json j = json::object({});
+  j["policy"] = json_fmt(o.policy);
+  j["min_inflight"] = json_fmt(o.min_inflight);
+  j["max_inflight"] = json_fmt(o.max_inflight);
+  j["target_latency_us"] = json_fmt(o.target_latency_us);
+  j["ops_rate"] = json_fmt(o.ops_rate);
+  j["ops_burst"] = json_fmt(o.ops_burst);
+  return std::move(j);
+}
+
+json json_fmt(const rbdx::throttle_state_t& o) {
+  json j = json::object({});
+  j["config"] = json_fmt(o.config);
+  j["window"] = json_fmt(o.window);
+  j["inflight"] = json_fmt(o.inflight);
+  j["tokens"] = json_fmt(o.tokens);
+  j["latency_us"] = json_fmt(o.latency_us);
+  j["ops"] = json_fmt(o.ops);
+  j["throttled_ops"] = json_fmt(o.throttled_ops);
+  return std::move(j);
+}
+
 }
 
 namespace rbdx {
@@ -224,15 +286,390 @@ using json = nlohmann::json;
 
 constexpr int json_indent = 4;
 
-PYBIND11_MODULE(rbdx, m) {
+// admitted as an op of the xRados the xIoCtx was created from, which
+// `xRados.shutdown` waits for, and holds a private handle of the pool, so
+// other threads can close the xIoCtx, change its namespace or shutdown the
+// xRados while we are in flight, must be created with the GIL held, which
+// serializes it with those
+class ioctx_ref_t {
+public:
+  explicit ioctx_ref_t(radosx::xIoCtx& ioctx) {
+    if (!ioctx.is_valid()) {
+      return;
+    }
+    if (ioctx.gate) {
+      // -EBADF if the xRados is shutting down or has been reconnected
+      op.reset(new radosx::op_t(ioctx.gate.get(), ioctx.epoch));
+      if (op->r < 0) {
+        op.reset();
+        return;
+      }
+      gate = ioctx.gate;
+    }
+    // a new IoCtxImpl, a copy would share the one of `ioctx`, namespace
+    // included
+    this->ioctx.dup(ioctx);
+    this->ioctx.gate = ioctx.gate;
+    this->ioctx.epoch = ioctx.epoch;
+    this->ioctx.fsid = ioctx.fsid;
+  }
 
-  m.attr("CEPH_NOSNAP") = py::int_(CEPH_NOSNAP);
+  bool is_valid() const {
+    return ioctx.is_valid();
+  }
+
+private:
+  // released after `ioctx`, in reverse order
+  std::shared_ptr<radosx::gate_t> gate;
+  std::unique_ptr<radosx::op_t> op;
+
+public:
+  radosx::xIoCtx ioctx;
+};
+
+id_cache_t& id_cache() {
+  static id_cache_t cache;
+  return cache;
+}
+
+throttle_t& throttle() {
+  static throttle_t throttle;
+  return throttle;
+}
+
+// keyed by the cluster too, the same pool id and namespace of two clusters
+// are different pools
+id_cache_t::pool_t pool_of(radosx::xIoCtx& ioctx) {
+  return std::make_tuple(ioctx.fsid, ioctx.get_id(), ioctx.get_namespace());
+}
+
+void seed_id_cache(radosx::xIoCtx& ioctx, const Map_string_2_pair_image_info_t_int& infos) {
+  std::map<std::string, std::string> images;
+  for (auto& it : infos) {
+    if (it.second.second == 0) {
+      images.emplace_hint(images.end(), it.first, it.second.first.name);
+    }
+  }
+  id_cache().put(pool_of(ioctx), images, false);
+}
+
+// a get_info that has started is not interrupted, so `deadline` and `token`
+// are only checked before it
+int get_info_bounded(IoCtx& ioctx,
+    const std::string& image_name,
+    const std::string& image_id,
+    image_info_t* info,
+    uint64_t flags,
+    const deadline_t& deadline,
+    cancel_token_t* token) {
+  int r = check_deadline(deadline, token);
+  if (r < 0) {
+    return r;
+  }
+  return get_info(ioctx, image_name, image_id, info, flags);
+}
+
+// list_info of `images`, or of the pool if null, as a batch_scan_t, on
+// -ETIMEDOUT/-ECANCELED the images that were done keep their results and
+// the rest are marked with the error
+int list_info_bounded(IoCtx& ioctx,
+    const images_t* images,
+    Map_string_2_pair_image_info_t_int* infos,
+    uint64_t flags,
+    const deadline_t& deadline,
+    cancel_token_t* token) {
+  images_t listed;
+  if (images == nullptr) {
+    int r = list(ioctx, &listed);
+    if (r < 0) {
+      return r;
+    }
+    images = &listed;
+  }
+  batch_scan_t scan(*images, SCAN_BATCH_SIZE, deadline, token, &throttle());
+  return scan.run(
+      [&](const images_t& batch, infos_t* batch_infos) {
+        return list_info(ioctx, batch, batch_infos, flags);
+      },
+      [&](const std::string& image_id, image_info_t&& info, int r) {
+        infos->emplace(image_id, std::make_pair(std::move(info), r));
+        return 0;
+      },
+      SCAN_WORKERS);
+}
+
+// live and trashed images of all the namespaces of the pool, keyed by id,
+// which is unique in a pool. a namespace at a time, each of them a
+// batch_scan_t of its directory and trash, through a private handle set to
+// it. the live images of a namespace that was listed in full replace what
+// the id cache has for it
+int list_pool_info(radosx::xIoCtx& ioctx,
+    Map_string_2_pair_pool_image_info_t_int* infos,
+    uint64_t flags,
+    const deadline_t& deadline,
+    cancel_token_t* token) {
+  librbd::RBD rbd;
+  std::vector<std::string> namespaces;
+  int r = rbd.namespace_list(ioctx, &namespaces);
+  if (r < 0) {
+    return r;
+  }
+  // not listed
+  namespaces.insert(namespaces.begin(), "");
+
+  for (auto& ns : namespaces) {
+    r = check_deadline(deadline, token);
+    if (r < 0) {
+      return r;
+    }
+    IoCtx nsctx;
+    nsctx.dup(ioctx);
+    nsctx.set_namespace(ns);
+
+    images_t images;
+    r = list(nsctx, &images);
+    if (r < 0) {
+      return r;
+    }
+    std::vector<librbd::trash_image_info_t> trash;
+    r = rbd.trash_list(nsctx, trash);
+    if (r < 0) {
+      return r;
+    }
+    id_cache().put(std::make_tuple(ioctx.fsid, ioctx.get_id(), ns), images, true);
+
+    std::map<std::string, image_source_t> sources;
+    for (auto& it : images) {
+      sources[it.first] = image_source_t{ns, image_state_t::IMAGE_STATE_LIVE,
+          0, 0};
+    }
+    // an image being moved to the trash may show up in both, it is on its
+    // way out so the trash wins
+    for (auto& t : trash) {
+      images.emplace(t.id, t.name);
+      sources[t.id] = image_source_t{ns, image_state_t::IMAGE_STATE_TRASH,
+          static_cast<int64_t>(t.deletion_time),
+          static_cast<int64_t>(t.deferment_end_time)};
+    }
+
+    batch_scan_t scan(images, SCAN_BATCH_SIZE, deadline, token, &throttle());
+    r = scan.run(
+        [&](const images_t& batch, infos_t* batch_infos) {
+          return list_info(nsctx, batch, batch_infos, flags);
+        },
+        [&](const std::string& image_id, image_info_t&& info, int r) {
+          infos->emplace(image_id, std::make_pair(
+              pool_image_info_t{std::move(sources[image_id]), std::move(info)}, r));
+          return 0;
+        },
+        SCAN_WORKERS);
+    if (r < 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+// name based lookups go through the id cache, so they skip the name -> id
+// lookup when hit, i.e., the image is read by the cached id with the name
+// taken as is. an image that is gone fails with -ENOENT, which drops the
+// entry and retries by name, while a renamed image is still found by its
+// old name until the entry expires (see set_id_cache_ttl) or a listing of
+// the pool replaces it
+int get_info_cached(radosx::xIoCtx& ioctx,
+    const std::string& image_name,
+    const std::string& image_id,
+    image_info_t* info,
+    uint64_t flags,
+    const deadline_t& deadline,
+    cancel_token_t* token) {
+  if (!image_id.empty() || image_name.empty()) {
+    return get_info_bounded(ioctx, image_name, image_id, info, flags, deadline, token);
+  }
+
+  auto pool = pool_of(ioctx);
+  std::string id;
+  if (id_cache().get(pool, image_name, &id)) {
+    int r = get_info_bounded(ioctx, image_name, id, info, flags, deadline, token);
+    if (r != -ENOENT) {
+      return r;
+    }
+    id_cache().invalidate(pool, image_name);
+    *info = image_info_t{};
+  }
+
+  int r = get_info_bounded(ioctx, image_name, "", info, flags, deadline, token);
+  if (r == 0) {
+    id_cache().put(pool, image_name, info->id);
+  }
+  return r;
+}
+
+// iterator over a spill_map_t, holds a reference on the map so it can
+// outlive the view it is created from
+struct spill_map_iterator_t {
+  enum kind_t {
+    KEYS,
+    VALUES,
+    ITEMS,
+  };
+
+  spill_map_iterator_t(std::shared_ptr<spill_map_t> m, kind_t kind)
+    : m(std::move(m)), cursor(*this->m), kind(kind) {}
+
+  std::shared_ptr<spill_map_t> m;
+  spill_map_t::cursor_t cursor;
+  kind_t kind;
+};
+
+[[noreturn]] void throw_os_error(int r) {
+  errno = -r;
+  PyErr_SetFromErrno(PyExc_OSError);
+  throw py::error_already_set();
+}
+
+// rough footprint of an image_info_t that has yet to be handed over to the
+// spill map, more with many snapshots or metadata
+constexpr uint64_t SPILL_INFO_BYTES = 4096;
+
+// the batches in flight are held outside of the spill map, so they are
+// sized for all of them to fit in about `memory_budget` too
+size_t spill_batch_size(uint64_t memory_budget) {
+  uint64_t n = memory_budget / (SCAN_WORKERS * SPILL_INFO_BYTES);
+  if (n == 0) {
+    return 1;
+  }
+  return (n < SCAN_BATCH_SIZE) ? static_cast<size_t>(n) : SCAN_BATCH_SIZE;
+}
+
+// list_info as a batch_scan_t with the results of every batch handed over
+// to a spill_map_t as soon as it is done, so at most about `memory_budget`
+// bytes of them are held in memory, the rest go to a temporary file. if
+// spilling fails the scan stops and r is the error of the spill
+py::object list_info_spilled(radosx::xIoCtx& ioctx,
+    const std::map<std::string, std::string>* images, // <id, name>
+    uint64_t flags,
+    double timeout,
+    cancel_token_t* token,
+    uint64_t memory_budget) {
+  auto infos = std::make_shared<spill_map_t>(memory_budget);
+  ioctx_ref_t ref(ioctx);
+  if (!ref.is_valid()) {
+    return py::cast(std::make_pair(std::move(infos), -EBADF));
+  }
+
+  int r;
+  {
+    py::gil_scoped_release release;
+    images_t listed;
+    if (images == nullptr) {
+      r = list(ref.ioctx, &listed);
+      images = &listed;
+    } else {
+      r = 0;
+    }
+    auto pool = pool_of(ref.ioctx);
+    int spill_r = 0;
+    if (r == 0) {
+      batch_scan_t scan(*images, spill_batch_size(memory_budget),
+          make_deadline(timeout), token, &throttle());
+      r = scan.run(
+          [&](const images_t& batch, infos_t* batch_infos) {
+            return list_info(ref.ioctx, batch, batch_infos, flags);
+          },
+          // serialized by batch_scan_t
+          [&](const std::string& image_id, image_info_t&& info, int r) {
+            if (spill_r < 0) {
+              return spill_r;
+            }
+            if (r == 0) {
+              id_cache().put(pool, info.name, image_id);
+            }
+            spill_r = infos->add(image_id, std::make_pair(std::move(info), r));
+            return spill_r;
+          },
+          SCAN_WORKERS);
+    }
+    if (spill_r < 0) {
+      r = spill_r;
+    }
+  }
+  return py::cast(std::make_pair(std::move(infos), r));
+}
+
+// owns an encoded blob, so pickle protocol 5 can hand it out of band
+// through PickleBuffer without another copy
+struct encoded_t {
+  std::string bl;
+};
+
+template <typename T>
+T decode_buffer(py::buffer b) {
+  py::buffer_info info = b.request();
+  T o;
+  int r = decode_versioned(static_cast<const char*>(info.ptr),
+      info.size * info.itemsize, &o);
+  if (r < 0) {
+    throw std::invalid_argument("failed to decode, r = " + std::to_string(r));
+  }
+  return o;
+}
+
+template <typename T, typename... Ts>
+void def_pickle(py::class_<T, Ts...>& cls) {
+  cls.def(py::pickle(
+      [](const T& self) {
+        return py::bytes(encode_versioned(self));
+      },
+      [](py::buffer b) {
+        return decode_buffer<T>(b);
+      }));
+  // same as object.__reduce_ex__ except for the state, which is passed out
+  // of band as of protocol 5
+  cls.def("__reduce_ex__", [](py::object self, int protocol) {
+    auto bl = encode_versioned(self.cast<const T&>());
+    py::object state;
+    if (protocol >= 5) {
+      auto encoded = py::cast(encoded_t{std::move(bl)});
+      state = py::module::import("pickle").attr("PickleBuffer")(encoded);
+    } else {
+      state = py::bytes(bl);
+    }
+#if PY_MAJOR_VERSION >= 3
+    auto copyreg = py::module::import("copyreg");
+#else
+    auto copyreg = py::module::import("copy_reg");
+#endif
+    return py::make_tuple(copyreg.attr("__newobj__"),
+        py::make_tuple(self.attr("__class__")), state);
+  });
+}
+
+void init_types(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+
+  {
+    py::class_<encoded_t> cls(m, "encoded_t", py::buffer_protocol());
+    cls.def_buffer([](encoded_t& self) {
+      return py::buffer_info(&self.bl[0], 1,
+          py::format_descriptor<uint8_t>::format(), 1,
+          {self.bl.size()}, {1}, true);
+    });
+    cls.def("__len__", [](const encoded_t& self) {
+      return self.bl.size();
+    });
+  }
 
   {
     auto b = py::bind_map<Map_string_2_pair_image_info_t_int>(m, "Map_string_2_pair_image_info_t_int");
     b.def("__repr__", [](const Map_string_2_pair_image_info_t_int& self) {
       return json_fmt(self).dump(json_indent);
     });
+    def_pickle(b);
   }
 
   {
@@ -277,6 +714,7 @@ PYBIND11_MODULE(rbdx, m) {
     cls.def("__repr__", [](const parent_t& self) {
       return json_fmt(self).dump(json_indent);
     });
+    def_pickle(cls);
   }
 
   {
@@ -288,6 +726,7 @@ PYBIND11_MODULE(rbdx, m) {
     cls.def("__repr__", [](const child_t& self) {
       return json_fmt(self).dump(json_indent);
     });
+    def_pickle(cls);
   }
 
   {
@@ -306,6 +745,7 @@ PYBIND11_MODULE(rbdx, m) {
     cls.def("__repr__", [](const snap_info_t& self) {
       return json_fmt(self).dump(json_indent);
     });
+    def_pickle(cls);
   }
 
   {
@@ -331,6 +771,231 @@ PYBIND11_MODULE(rbdx, m) {
     cls.def("__repr__", [](const image_info_t& self) {
       return json_fmt(self).dump(json_indent);
     });
+    def_pickle(cls);
+  }
+
+  {
+    py::class_<cancel_token_t> cls(m, "cancel_token_t");
+    cls.def(py::init<>());
+    cls.def("cancel", &cancel_token_t::cancel);
+    cls.def_property_readonly("canceled", &cancel_token_t::is_canceled);
+  }
+}
+
+void init_throttle(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+
+  {
+    py::enum_<throttle_policy_t> e(m, "throttle_policy_t", py::arithmetic());
+    e.value("THROTTLE_POLICY_NONE", throttle_policy_t::THROTTLE_POLICY_NONE);
+    e.value("THROTTLE_POLICY_AIMD", throttle_policy_t::THROTTLE_POLICY_AIMD);
+    e.value("THROTTLE_POLICY_GRADIENT", throttle_policy_t::THROTTLE_POLICY_GRADIENT);
+    e.export_values();
+  }
+
+  {
+    py::class_<throttle_config_t> cls(m, "throttle_config_t");
+    cls.def(py::init<>());
+    cls.def_readwrite("policy", &throttle_config_t::policy);
+    cls.def_readwrite("min_inflight", &throttle_config_t::min_inflight);
+    cls.def_readwrite("max_inflight", &throttle_config_t::max_inflight);
+    cls.def_readwrite("target_latency_us", &throttle_config_t::target_latency_us);
+    cls.def_readwrite("ops_rate", &throttle_config_t::ops_rate);
+    cls.def_readwrite("ops_burst", &throttle_config_t::ops_burst);
+    cls.def("__repr__", [](const throttle_config_t& self) {
+      return json_fmt(self).dump(json_indent);
+    });
+  }
+
+  {
+    py::class_<throttle_state_t> cls(m, "throttle_state_t");
+    cls.def(py::init<>());
+    cls.def_readonly("config", &throttle_state_t::config);
+    cls.def_readonly("window", &throttle_state_t::window);
+    cls.def_readonly("inflight", &throttle_state_t::inflight);
+    cls.def_readonly("tokens", &throttle_state_t::tokens);
+    cls.def_readonly("latency_us", &throttle_state_t::latency_us);
+    cls.def_readonly("ops", &throttle_state_t::ops);
+    cls.def_readonly("throttled_ops", &throttle_state_t::throttled_ops);
+    cls.def("__repr__", [](const throttle_state_t& self) {
+      return json_fmt(self).dump(json_indent);
+    });
+  }
+
+  {
+    // of all the calls to librbdx, i.e., get_info and the batches of the
+    // list_info scans, the window and rate are in images
+    m.def("set_throttle",
+        [](const throttle_config_t& config) {
+          return throttle().set_config(config);
+        },
+        py::arg("config"));
+
+    m.def("get_throttle",
+        []() {
+          return std::make_pair(throttle().get_state(), 0);
+        });
+  }
+}
+
+void init_xrbd(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+  init_types(m);
+
+  {
+    // same lookup and iteration API as Map_string_2_pair_image_info_t_int,
+    // entries that were spilled are read back on demand
+    py::class_<spill_map_t, std::shared_ptr<spill_map_t>> cls(m, "spill_map_t");
+    cls.def("__len__", &spill_map_t::size);
+    cls.def_property_readonly("num_runs", &spill_map_t::num_runs);
+    cls.def("__contains__", [](const spill_map_t& self, const std::string& key) {
+      spill_map_t::value_type v;
+      int r;
+      {
+        py::gil_scoped_release release;
+        r = self.get(key, &v);
+      }
+      if (r < 0 && r != -ENOENT) {
+        throw_os_error(r);
+      }
+      return r == 0;
+    });
+    cls.def("__getitem__", [](const spill_map_t& self, const std::string& key) {
+      spill_map_t::value_type v;
+      int r;
+      {
+        py::gil_scoped_release release;
+        r = self.get(key, &v);
+      }
+      if (r == -ENOENT) {
+        throw py::key_error(key);
+      } else if (r < 0) {
+        throw_os_error(r);
+      }
+      return v;
+    });
+    cls.def("__iter__", [](std::shared_ptr<spill_map_t> self) {
+      return spill_map_iterator_t(std::move(self), spill_map_iterator_t::KEYS);
+    });
+    cls.def("keys", [](std::shared_ptr<spill_map_t> self) {
+      return spill_map_iterator_t(std::move(self), spill_map_iterator_t::KEYS);
+    });
+    cls.def("values", [](std::shared_ptr<spill_map_t> self) {
+      return spill_map_iterator_t(std::move(self), spill_map_iterator_t::VALUES);
+    });
+    cls.def("items", [](std::shared_ptr<spill_map_t> self) {
+      return spill_map_iterator_t(std::move(self), spill_map_iterator_t::ITEMS);
+    });
+    cls.def("__repr__", [](const spill_map_t& self) {
+      json j = json::object({});
+      spill_map_t::cursor_t cursor(self);
+      std::string key;
+      spill_map_t::value_type v;
+      int r;
+      while ((r = cursor.next(&key, &v)) > 0) {
+        j[key] = json_fmt(v);
+      }
+      if (r < 0) {
+        throw_os_error(r);
+      }
+      return j.dump(json_indent);
+    });
+    // the state is the memory budget and the same blob as the pickle of
+    // Map_string_2_pair_image_info_t_int, all the entries are read back to
+    // produce it, while unpickling spills with the budget again
+    auto dump = [](const spill_map_t& self) {
+      std::string bl;
+      int r;
+      {
+        py::gil_scoped_release release;
+        r = self.dump(&bl);
+      }
+      if (r < 0) {
+        throw_os_error(r);
+      }
+      return bl;
+    };
+    cls.def(py::pickle(
+        [dump](const spill_map_t& self) {
+          return py::make_tuple(self.get_budget(), py::bytes(dump(self)));
+        },
+        [](py::tuple t) {
+          if (t.size() != 2) {
+            throw std::invalid_argument("invalid state");
+          }
+          auto self = std::make_shared<spill_map_t>(t[0].cast<uint64_t>());
+          py::buffer_info info = t[1].cast<py::buffer>().request();
+          int r;
+          {
+            py::gil_scoped_release release;
+            r = self->load(static_cast<const char*>(info.ptr),
+                info.size * info.itemsize);
+          }
+          if (r == -EINVAL || r == -EOPNOTSUPP) {
+            throw std::invalid_argument("failed to decode, r = " + std::to_string(r));
+          } else if (r < 0) {
+            throw_os_error(r);
+          }
+          return self;
+        }));
+    // as def_pickle, with the blob out of band as of protocol 5
+    cls.def("__reduce_ex__", [dump](py::object self, int protocol) {
+      auto& o = self.cast<const spill_map_t&>();
+      auto bl = dump(o);
+      py::object blob;
+      if (protocol >= 5) {
+        auto encoded = py::cast(encoded_t{std::move(bl)});
+        blob = py::module::import("pickle").attr("PickleBuffer")(encoded);
+      } else {
+        blob = py::bytes(bl);
+      }
+#if PY_MAJOR_VERSION >= 3
+      auto copyreg = py::module::import("copyreg");
+#else
+      auto copyreg = py::module::import("copy_reg");
+#endif
+      return py::make_tuple(copyreg.attr("__newobj__"),
+          py::make_tuple(self.attr("__class__")),
+          py::make_tuple(o.get_budget(), blob));
+    });
+  }
+
+  {
+    py::class_<spill_map_iterator_t> cls(m, "spill_map_iterator_t");
+    cls.def("__iter__", [](py::object self) {
+      return self;
+    });
+    auto next = [](spill_map_iterator_t& self) -> py::object {
+      std::string key;
+      spill_map_t::value_type v;
+      // with the GIL held, the cursor may be shared by threads
+      int r = self.cursor.next(&key, &v);
+      if (r < 0) {
+        throw_os_error(r);
+      } else if (r == 0) {
+        throw py::stop_iteration();
+      }
+      switch (self.kind) {
+      case spill_map_iterator_t::KEYS:
+        return py::cast(key);
+      case spill_map_iterator_t::VALUES:
+        return py::cast(std::move(v));
+      default:
+        return py::cast(std::make_pair(std::move(key), std::move(v)));
+      }
+    };
+    cls.def("__next__", next);
+#if PY_MAJOR_VERSION < 3
+    cls.def("next", next);
+#endif
   }
 
   //
@@ -338,52 +1003,595 @@ PYBIND11_MODULE(rbdx, m) {
   //
   {
     m.def("get_info",
-        [](librados::IoCtx& ioctx,
+        [](radosx::xIoCtx& ioctx,
             const std::string& image_name,
             const std::string& image_id,
-            uint64_t flags) {
+            uint64_t flags,
+            double timeout,
+            cancel_token_t* token) {
           image_info_t info;
-          int r = get_info(ioctx, image_name, image_id, &info, flags);
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return std::make_pair(info, -EBADF);
+          }
+          py::gil_scoped_release release;
+          auto deadline = make_deadline(timeout);
+          throttle_op_t op(&throttle(), 1, deadline, token);
+          if (op.r < 0) {
+            return std::make_pair(info, op.r);
+          }
+          int r = get_info_cached(ref.ioctx, image_name, image_id, &info, flags,
+              deadline, token);
           return std::make_pair(info, r);
         },
-        py::call_guard<py::gil_scoped_release>(),
         py::arg("ioctx"),
         py::arg("image_name"),
         py::arg("image_id"),
-        py::arg("flags") = 0);
+        py::arg("flags") = 0,
+        py::arg("timeout") = 0.0,
+        py::arg("token") = nullptr);
 
     m.def("list",
-        [](librados::IoCtx& ioctx) {
+        [](radosx::xIoCtx& ioctx) {
           std::map<std::string, std::string> images;
-          int r = list(ioctx, &images);
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return std::make_pair(images, -EBADF);
+          }
+          py::gil_scoped_release release;
+          int r = list(ref.ioctx, &images);
+          if (r == 0) {
+            id_cache().put(pool_of(ref.ioctx), images, true);
+          }
           return std::make_pair(images, r);
+        });
+
+    m.def("resolve",
+        [](radosx::xIoCtx& ioctx, const std::set<std::string>& names) {
+          std::map<std::string, std::string> ids; // <name, id>
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return std::make_pair(ids, -EBADF);
+          }
+          py::gil_scoped_release release;
+          auto pool = pool_of(ref.ioctx);
+          std::set<std::string> misses;
+          for (auto& name : names) {
+            std::string id;
+            if (id_cache().get(pool, name, &id)) {
+              ids.emplace(name, std::move(id));
+            } else {
+              misses.insert(name);
+            }
+          }
+          if (misses.empty()) {
+            return std::make_pair(ids, 0);
+          }
+          // one read of the directory for all of them, which refreshes
+          // the whole pool in the cache too
+          std::map<std::string, std::string> images; // <id, name>
+          int r = list(ref.ioctx, &images);
+          if (r < 0) {
+            return std::make_pair(ids, r);
+          }
+          id_cache().put(pool, images, true);
+          for (auto& it : images) {
+            if (misses.count(it.second)) {
+              ids.emplace(it.second, it.first);
+            }
+          }
+          return std::make_pair(ids, 0);
+        },
+        py::arg("ioctx"),
+        py::arg("names"));
+
+    m.def("invalidate_id_cache",
+        [](radosx::xIoCtx* ioctx) {
+          if (ioctx == nullptr) {
+            id_cache().clear();
+          } else if (ioctx->is_valid()) {
+            id_cache().clear(pool_of(*ioctx));
+          }
+        },
+        py::arg("ioctx") = nullptr);
+
+    m.def("set_id_cache_ttl",
+        [](double ttl) {
+          auto d = std::chrono::duration<double>(ttl);
+          id_cache().set_ttl(
+              std::chrono::duration_cast<id_cache_t::clock::duration>(d));
         },
-        py::call_guard<py::gil_scoped_release>());
+        py::arg("ttl"));
 
+    // a non-zero `memory_budget` returns a spill_map_t instead of a
+    // Map_string_2_pair_image_info_t_int
     m.def("list_info",
-        [](librados::IoCtx& ioctx, uint64_t flags) {
+        [](radosx::xIoCtx& ioctx, uint64_t flags,
+            double timeout, cancel_token_t* token,
+            uint64_t memory_budget) -> py::object {
+          if (memory_budget > 0) {
+            return list_info_spilled(ioctx, nullptr, flags, timeout, token,
+                memory_budget);
+          }
           using T = Map_string_2_pair_image_info_t_int;
           auto infos = std::unique_ptr<T>(new Map_string_2_pair_image_info_t_int{});
-          int r = list_info(ioctx, infos.get(), flags);
-          return std::make_pair(std::move(infos), r);
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return py::cast(std::make_pair(std::move(infos), -EBADF));
+          }
+          int r;
+          {
+            py::gil_scoped_release release;
+            r = list_info_bounded(ref.ioctx, nullptr, infos.get(), flags,
+                make_deadline(timeout), token);
+            seed_id_cache(ref.ioctx, *infos);
+          }
+          return py::cast(std::make_pair(std::move(infos), r));
         },
-        py::call_guard<py::gil_scoped_release>(),
         py::arg("ioctx"),
-        py::arg("flags") = 0);
+        py::arg("flags") = 0,
+        py::arg("timeout") = 0.0,
+        py::arg("token") = nullptr,
+        py::arg("memory_budget") = 0);
 
     m.def("list_info",
-        [](librados::IoCtx& ioctx, const std::map<std::string, std::string>& images, // <id, name>
-            uint64_t flags) {
+        [](radosx::xIoCtx& ioctx, const std::map<std::string, std::string>& images, // <id, name>
+            uint64_t flags,
+            double timeout, cancel_token_t* token,
+            uint64_t memory_budget) -> py::object {
+          if (memory_budget > 0) {
+            return list_info_spilled(ioctx, &images, flags, timeout, token,
+                memory_budget);
+          }
           using T = Map_string_2_pair_image_info_t_int;
           auto infos = std::unique_ptr<T>(new Map_string_2_pair_image_info_t_int{});
-          int r = list_info(ioctx, images, infos.get(), flags);
-          return std::make_pair(std::move(infos), r);
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return py::cast(std::make_pair(std::move(infos), -EBADF));
+          }
+          int r;
+          {
+            py::gil_scoped_release release;
+            r = list_info_bounded(ref.ioctx, &images, infos.get(), flags,
+                make_deadline(timeout), token);
+            seed_id_cache(ref.ioctx, *infos);
+          }
+          return py::cast(std::make_pair(std::move(infos), r));
         },
-        py::call_guard<py::gil_scoped_release>(),
         py::arg("ioctx"),
         py::arg("images"),
-        py::arg("flags") = 0);
+        py::arg("flags") = 0,
+        py::arg("timeout") = 0.0,
+        py::arg("token") = nullptr,
+        py::arg("memory_budget") = 0);
+  }
+}
+
+// a str for a key or a (key, value) tuple
+std::vector<meta_term_t> to_meta_terms(py::iterable terms) {
+  std::vector<meta_term_t> v;
+  for (auto t : terms) {
+    meta_term_t term;
+    if (py::isinstance<py::tuple>(t)) {
+      auto kv = t.cast<std::pair<std::string, std::string>>();
+      term.key = std::move(kv.first);
+      term.value = std::move(kv.second);
+      term.has_value = true;
+    } else {
+      term.key = t.cast<std::string>();
+    }
+    v.push_back(std::move(term));
+  }
+  return v;
+}
+
+void init_meta_index(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+  init_types(m);
+
+  {
+    // a term is either a key or a (key, value) pair
+    py::class_<meta_index_t> cls(m, "meta_index_t");
+    cls.def(py::init<>());
+    cls.def("__len__", &meta_index_t::size);
+    cls.def("clear", &meta_index_t::clear);
+    cls.def("build", &meta_index_t::build, py::arg("infos"));
+    cls.def("update", &meta_index_t::update, py::arg("info"));
+    cls.def("remove", &meta_index_t::remove, py::arg("image_id"));
+    cls.def("find", [](const meta_index_t& self, const std::string& key,
+        py::object value) {
+      meta_term_t term;
+      term.key = key;
+      if (!value.is_none()) {
+        term.value = value.cast<std::string>();
+        term.has_value = true;
+      }
+      return self.to_ids(self.find(term));
+    }, py::arg("key"), py::arg("value") = py::none());
+    cls.def("find_prefix", [](const meta_index_t& self, const std::string& prefix) {
+      return self.to_ids(self.find_prefix(prefix));
+    }, py::arg("prefix"));
+    cls.def("find_all", [](const meta_index_t& self, py::iterable terms) {
+      return self.to_ids(self.find_all(to_meta_terms(terms)));
+    }, py::arg("terms"));
+    cls.def("find_any", [](const meta_index_t& self, py::iterable terms) {
+      return self.to_ids(self.find_any(to_meta_terms(terms)));
+    }, py::arg("terms"));
+  }
+}
+
+// result of history_t.query, exposed as a 2-D int64 buffer, one row per
+// sample and one column per history_t::column_t
+struct history_samples_t {
+  std::vector<history_t::sample_t> samples;
+};
+
+void init_history(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+  init_types(m);
+
+  {
+    py::class_<history_samples_t> cls(m, "history_samples_t", py::buffer_protocol());
+    cls.def_buffer([](history_samples_t& self) {
+      return py::buffer_info(self.samples.data(), sizeof(int64_t),
+          py::format_descriptor<int64_t>::format(), 2,
+          {self.samples.size(), history_t::COLUMNS},
+          {sizeof(history_t::sample_t), sizeof(int64_t)}, true);
+    });
+    cls.def("__len__", [](const history_samples_t& self) {
+      return self.samples.size();
+    });
+  }
+
+  {
+    py::class_<history_t> cls(m, "history_t");
+    cls.attr("columns") = py::make_tuple("timestamp", "size", "du", "dirty", "snaps");
+    cls.def(py::init<>());
+    cls.def("__len__", &history_t::size);
+    cls.def_property_readonly("samples", &history_t::samples);
+    cls.def_property_readonly("bytes", &history_t::bytes);
+    cls.def("image_ids", &history_t::image_ids);
+    cls.def("append",
+        [](history_t& self, int64_t timestamp,
+            const Map_string_2_pair_image_info_t_int& infos) {
+          return self.append(timestamp, infos);
+        },
+        py::arg("timestamp"),
+        py::arg("infos"));
+    cls.def("append",
+        [](history_t& self, int64_t timestamp, const image_info_t& info) {
+          return self.append(info.id, history_t::make_sample(timestamp, info));
+        },
+        py::arg("timestamp"),
+        py::arg("info"));
+    cls.def("remove", &history_t::remove, py::arg("image_id"));
+    cls.def("query",
+        [](const history_t& self, const std::string& image_id,
+            int64_t start, int64_t end, int64_t step) {
+          return history_samples_t{self.query(image_id, start, end, step)};
+        },
+        py::arg("image_id"),
+        py::arg("start"),
+        py::arg("end"),
+        py::arg("step") = 0);
+    // the GIL is held while saving, history_t has no lock of its own
+    cls.def("save", &history_t::save, py::arg("path"));
+    cls.def("load",
+        [](history_t& self, const std::string& path) {
+          history_t loaded;
+          int r;
+          {
+            py::gil_scoped_release release;
+            r = loaded.load(path);
+          }
+          if (r == 0) {
+            std::swap(self, loaded);
+          }
+          return r;
+        },
+        py::arg("path"));
+    def_pickle(cls);
+  }
+
+  {
+    // the GIL is held throughout, a query reads only the blocks it needs
+    // and `open` must not close the file under it
+    py::class_<history_file_t> cls(m, "history_file_t");
+    cls.def(py::init<>());
+    cls.def("open", &history_file_t::open, py::arg("path"));
+    cls.def("close", &history_file_t::close);
+    cls.def("__len__", &history_file_t::size);
+    cls.def_property_readonly("samples", &history_file_t::samples);
+    cls.def("image_ids", &history_file_t::image_ids);
+    cls.def("query",
+        [](const history_file_t& self, const std::string& image_id,
+            int64_t start, int64_t end, int64_t step) {
+          history_samples_t samples;
+          int r = self.query(image_id, start, end, step, &samples.samples);
+          return std::make_pair(std::move(samples), r);
+        },
+        py::arg("image_id"),
+        py::arg("start"),
+        py::arg("end"),
+        py::arg("step") = 0);
+  }
+}
+
+void init_pool(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+  init_types(m);
+
+  {
+    py::enum_<image_state_t> e(m, "image_state_t", py::arithmetic());
+    e.value("IMAGE_STATE_LIVE", image_state_t::IMAGE_STATE_LIVE);
+    e.value("IMAGE_STATE_TRASH", image_state_t::IMAGE_STATE_TRASH);
+    e.export_values();
+  }
+
+  {
+    py::class_<image_source_t> cls(m, "image_source_t");
+    cls.def(py::init<>());
+    cls.def_readonly("pool_namespace", &image_source_t::pool_namespace);
+    cls.def_readonly("state", &image_source_t::state);
+    cls.def_readonly("deletion_timestamp", &image_source_t::deletion_timestamp);
+    cls.def_readonly("deferment_end_timestamp", &image_source_t::deferment_end_timestamp);
+    cls.def("__repr__", [](const image_source_t& self) {
+      return json_fmt(self).dump(json_indent);
+    });
+    def_pickle(cls);
+  }
+
+  {
+    py::class_<pool_image_info_t> cls(m, "pool_image_info_t");
+    cls.def(py::init<>());
+    cls.def_readonly("source", &pool_image_info_t::source);
+    cls.def_readonly("info", &pool_image_info_t::info);
+    cls.def("__repr__", [](const pool_image_info_t& self) {
+      return json_fmt(self).dump(json_indent);
+    });
+    def_pickle(cls);
+  }
+
+  {
+    auto b = py::bind_map<Map_string_2_pair_pool_image_info_t_int>(m, "Map_string_2_pair_pool_image_info_t_int");
+    b.def("__repr__", [](const Map_string_2_pair_pool_image_info_t_int& self) {
+      return json_fmt(self).dump(json_indent);
+    });
+    def_pickle(b);
+  }
+
+  {
+    // live and trashed images of all the namespaces of the pool, the live
+    // ones seed the id cache of their namespace
+    m.def("list_pool_info",
+        [](radosx::xIoCtx& ioctx, uint64_t flags,
+            double timeout, cancel_token_t* token) {
+          using T = Map_string_2_pair_pool_image_info_t_int;
+          auto infos = std::unique_ptr<T>(new Map_string_2_pair_pool_image_info_t_int{});
+          ioctx_ref_t ref(ioctx);
+          if (!ref.is_valid()) {
+            return std::make_pair(std::move(infos), -EBADF);
+          }
+          py::gil_scoped_release release;
+          int r = list_pool_info(ref.ioctx, infos.get(), flags,
+              make_deadline(timeout), token);
+          return std::make_pair(std::move(infos), r);
+        },
+        py::arg("ioctx"),
+        py::arg("flags") = 0,
+        py::arg("timeout") = 0.0,
+        py::arg("token") = nullptr);
+  }
+}
+
+// a projection as a packed array of records, one class and one function
+// per projection, the records refer to the strings by index
+template <field_t Fields>
+void def_projection(py::module& m, const char* cls_name, const char* func_name) {
+  static_assert(has_field(Fields, field_t::FIELD_NAME),
+      "names() needs FIELD_NAME");
+  using P = projection_t<Fields>;
+  using R = typename P::record_type;
+
+  {
+    py::class_<P> cls(m, cls_name, py::buffer_protocol());
+    cls.def_buffer([](P& self) {
+      static const std::string format = P::format();
+      return py::buffer_info(const_cast<R*>(self.data()), sizeof(R),
+          format, 1, {self.size()}, {sizeof(R)}, true);
+    });
+    py::list fields;
+    for (auto& member : R::members()) {
+      fields.append(py::str(member.name));
+    }
+    cls.attr("fields") = py::tuple(fields);
+    cls.def("__len__", &P::size);
+    cls.def("get_string", &P::get_string, py::arg("index"));
+    cls.def("ids", [](const P& self) {
+      std::vector<std::string> v;
+      v.reserve(self.size());
+      for (size_t i = 0; i < self.size(); i++) {
+        v.push_back(self.get_string(self[i].id));
+      }
+      return v;
+    });
+    cls.def("names", [](const P& self) {
+      std::vector<std::string> v;
+      v.reserve(self.size());
+      for (size_t i = 0; i < self.size(); i++) {
+        v.push_back(self.get_string(self[i].name));
+      }
+      return v;
+    });
+  }
+
+  m.def(func_name,
+      [](radosx::xIoCtx& ioctx, double timeout, cancel_token_t* token) {
+        auto records = std::unique_ptr<P>(new P{});
+        ioctx_ref_t ref(ioctx);
+        if (!ref.is_valid()) {
+          return std::make_pair(std::move(records), -EBADF);
+        }
+        py::gil_scoped_release release;
+        int r = records->scan(ref.ioctx, make_deadline(timeout), token,
+            &throttle());
+        return std::make_pair(std::move(records), r);
+      },
+      py::arg("ioctx"),
+      py::arg("timeout") = 0.0,
+      py::arg("token") = nullptr);
+}
+
+void init_projection(py::module& m) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
+  init_types(m);
+
+  def_projection<field_t::FIELD_NAME | field_t::FIELD_SIZE>(
+      m, "size_records_t", "list_sizes");
+  def_projection<field_t::FIELD_NAME | field_t::FIELD_SIZE |
+      field_t::FIELD_FEATURES | field_t::FIELD_FLAGS>(
+      m, "feature_records_t", "list_features");
+  def_projection<field_t::FIELD_NAME | field_t::FIELD_SIZE |
+      field_t::FIELD_SNAPS | field_t::FIELD_DU>(
+      m, "usage_records_t", "list_usage");
+}
+
+// import only sets up `__getattr__`, the classes and functions are
+// registered by groups when first looked up, so one-shot tools do not pay
+// for the registration of what they never touch
+struct lazy_init_t {
+  void (*init)(py::module&);
+  std::vector<std::string> names;
+};
+
+const std::vector<lazy_init_t>& lazy_inits() {
+  static const std::vector<lazy_init_t> inits = {
+    {init_types, {
+      "encoded_t",
+      "Map_string_2_pair_image_info_t_int",
+      "info_filter_t",
+      "INFO_F_CHILDREN_V1", "INFO_F_IMAGE_DU", "INFO_F_SNAP_DU", "INFO_F_ALL",
+      "snap_type_t",
+      "SNAPSHOT_NAMESPACE_TYPE_USER", "SNAPSHOT_NAMESPACE_TYPE_GROUP",
+      "SNAPSHOT_NAMESPACE_TYPE_TRASH",
+      "snap_protection_status_t",
+      "PROTECTION_STATUS_UNPROTECTED", "PROTECTION_STATUS_UNPROTECTING",
+      "PROTECTION_STATUS_PROTECTED", "PROTECTION_STATUS_LAST",
+      "parent_t",
+      "child_t",
+      "snap_info_t",
+      "image_info_t",
+      "cancel_token_t",
+    }},
+    {init_throttle, {
+      "throttle_policy_t",
+      "THROTTLE_POLICY_NONE", "THROTTLE_POLICY_AIMD", "THROTTLE_POLICY_GRADIENT",
+      "throttle_config_t",
+      "throttle_state_t",
+      "set_throttle",
+      "get_throttle",
+    }},
+    {init_xrbd, {
+      "get_info",
+      "list",
+      "resolve",
+      "invalidate_id_cache",
+      "set_id_cache_ttl",
+      "list_info",
+      "spill_map_t",
+      "spill_map_iterator_t",
+    }},
+    {init_meta_index, {
+      "meta_index_t",
+    }},
+    {init_history, {
+      "history_samples_t",
+      "history_t",
+      "history_file_t",
+    }},
+    {init_pool, {
+      "image_state_t",
+      "IMAGE_STATE_LIVE", "IMAGE_STATE_TRASH",
+      "image_source_t",
+      "pool_image_info_t",
+      "Map_string_2_pair_pool_image_info_t_int",
+      "list_pool_info",
+    }},
+    {init_projection, {
+      "size_records_t",
+      "list_sizes",
+      "feature_records_t",
+      "list_features",
+      "usage_records_t",
+      "list_usage",
+    }},
+  };
+  return inits;
+}
+
+PYBIND11_MODULE(rbdx, m) {
+
+  m.attr("CEPH_NOSNAP") = py::int_(CEPH_NOSNAP);
+
+  // the lazily registered names are not in the module dict until first
+  // used, so `from rbdx import *` needs them listed
+  {
+    py::list all;
+    all.append(py::str("CEPH_NOSNAP"));
+    for (auto& i : lazy_inits()) {
+      for (auto& name : i.names) {
+        all.append(py::str(name));
+      }
+    }
+    m.attr("__all__") = all;
+  }
+
+#if PY_VERSION_HEX >= 0x03070000
+  // PEP 562, `m` rather than an import of "rbdx", which may not be in
+  // sys.modules under that name yet, or at all
+  m.def("__getattr__", [m](const std::string& name) mutable -> py::object {
+    for (auto& i : lazy_inits()) {
+      if (std::find(i.names.begin(), i.names.end(), name) != i.names.end()) {
+        i.init(m);
+        return m.attr(name.c_str());
+      }
+    }
+    PyErr_SetString(PyExc_AttributeError,
+        ("module 'rbdx' has no attribute '" + name + "'").c_str());
+    throw py::error_already_set();
+  });
+
+  m.def("__dir__", [m]() {
+    py::object dict = m.attr("__dict__");
+    py::list names(dict);
+    for (auto& i : lazy_inits()) {
+      for (auto& name : i.names) {
+        names.append(py::str(name));
+      }
+    }
+    return names;
+  });
+#else
+  for (auto& i : lazy_inits()) {
+    i.init(m);
   }
+#endif
 
 } // PYBIND11_MODULE(rbdx, m)
 
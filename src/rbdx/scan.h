@@ -0,0 +1,173 @@
+/*
+ * scan.h
+ */
+
+#ifndef SRC_RBDX_SCAN_H_
+#define SRC_RBDX_SCAN_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+#include "deadline.h"
+#include "throttle.h"
+
+namespace rbdx {
+
+using images_t = std::map<std::string, std::string>; // <id, name>
+using infos_t = std::map<std::string, std::pair<librbdx::image_info_t, int>>;
+
+// images per librbdx::list_info call, which pipelines the ops of a call
+constexpr size_t SCAN_BATCH_SIZE = 64;
+// calls in flight per scan
+constexpr size_t SCAN_WORKERS = 4;
+
+// runs one batch, i.e., librbdx::list_info of `batch`
+using batch_fn_t = std::function<int(const images_t& batch, infos_t* infos)>;
+// called once per image, the calls are serialized but may come from any
+// thread, a negative return stops the scan
+using scan_cb_t = std::function<int(const std::string& image_id,
+    librbdx::image_info_t&& info, int r)>;
+
+// list_info of `images` as batches run by a few threads, each admitted by
+// `throttle` (if not null) as a call of its images. the deadline and the
+// token are checked before each batch, while a batch that has started is
+// waited for, so the ops in flight are drained before `run` returns.
+// the images of a batch are handed to `cb` as soon as it is done, so at
+// most a few batches of results are held here
+class batch_scan_t {
+public:
+  batch_scan_t(const images_t& images, size_t batch_size,
+      const deadline_t& deadline,
+      cancel_token_t* token,
+      throttle_t* throttle)
+    : images(images),
+      batch_size(std::max<size_t>(1, batch_size)),
+      deadline(deadline),
+      token(token),
+      throttle(throttle),
+      next(images.begin()) {}
+
+  batch_scan_t(const batch_scan_t&) = delete;
+  batch_scan_t& operator=(const batch_scan_t&) = delete;
+
+  // 0 if every image was run, the errors of the images themselves are only
+  // passed to `cb`. otherwise the error that stopped the scan, i.e.,
+  // -ETIMEDOUT, -ECANCELED or the error of `fn` or `cb`, the images that
+  // were not run are passed to `cb` with it
+  int run(const batch_fn_t& fn, const scan_cb_t& cb, size_t workers) {
+    size_t batches = (images.size() + batch_size - 1) / batch_size;
+    workers = std::min(workers, batches);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) {
+      try {
+        threads.emplace_back([this, &fn, &cb] {
+          work(fn, cb);
+        });
+      } catch (const std::system_error&) {
+        // out of threads, make do with what we have
+        break;
+      }
+    }
+    work(fn, cb);
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    for (; next != images.end(); ++next) {
+      cb(next->first, librbdx::image_info_t{}, r);
+    }
+    return r;
+  }
+
+private:
+  void work(const batch_fn_t& fn, const scan_cb_t& cb) {
+    while (true) {
+      images_t batch;
+      {
+        std::lock_guard<std::mutex> l(lock);
+        if (r < 0) {
+          return;
+        }
+        for (size_t n = 0; n < batch_size && next != images.end(); n++, ++next) {
+          batch.emplace_hint(batch.end(), *next);
+        }
+        if (batch.empty()) {
+          return;
+        }
+      }
+
+      infos_t infos;
+      int batch_r = check_deadline(deadline, token);
+      if (batch_r == 0) {
+        batch_r = run_batch(fn, batch, &infos);
+      }
+      int cb_r = deliver(batch, &infos, batch_r, cb);
+
+      std::lock_guard<std::mutex> l(lock);
+      if (r == 0) {
+        r = (batch_r < 0) ? batch_r : cb_r;
+      }
+    }
+  }
+
+  int run_batch(const batch_fn_t& fn, const images_t& batch, infos_t* infos) {
+    if (throttle == nullptr) {
+      return fn(batch, infos);
+    }
+    throttle_op_t op(throttle, static_cast<uint32_t>(batch.size()), deadline,
+        token);
+    if (op.r < 0) {
+      return op.r;
+    }
+    return fn(batch, infos);
+  }
+
+  // every image of `batch`, the ones librbdx left out are -ENOENT
+  int deliver(const images_t& batch, infos_t* infos, int batch_r,
+      const scan_cb_t& cb) {
+    std::lock_guard<std::mutex> l(cb_lock);
+    int r = 0;
+    for (auto& it : batch) {
+      int cb_r;
+      auto iit = infos->find(it.first);
+      if (batch_r < 0) {
+        cb_r = cb(it.first, librbdx::image_info_t{}, batch_r);
+      } else if (iit == infos->end()) {
+        cb_r = cb(it.first, librbdx::image_info_t{}, -ENOENT);
+      } else {
+        cb_r = cb(it.first, std::move(iit->second.first), iit->second.second);
+      }
+      if (cb_r < 0 && r == 0) {
+        r = cb_r;
+      }
+    }
+    return r;
+  }
+
+  const images_t& images;
+  const size_t batch_size;
+  const deadline_t deadline;
+  cancel_token_t* token;
+  throttle_t* throttle;
+
+  // protects `next` and `r`
+  std::mutex lock;
+  images_t::const_iterator next;
+  int r = 0;
+  // serializes `cb`
+  std::mutex cb_lock;
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_SCAN_H_ */
@@ -0,0 +1,611 @@
+/*
+ * spill.h
+ */
+
+#ifndef SRC_RBDX_SPILL_H_
+#define SRC_RBDX_SPILL_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../rbd/librbdx.hpp"
+#include "encoding.h"
+
+namespace rbdx {
+
+// rough heap footprint of a list_info entry, used for the memory budget
+inline uint64_t approx_size(const std::string& id,
+    const std::pair<librbdx::image_info_t, int>& o) {
+  auto& info = o.first;
+  // per node overhead of std::map/std::set, i.e., 3 pointers and a color
+  constexpr uint64_t node = 32;
+
+  uint64_t n = node + sizeof(o) + id.size() + info.name.size() + info.id.size();
+  n += info.parent.pool_namespace.size() + info.parent.image_id.size();
+  for (auto& it : info.snaps) {
+    n += node + sizeof(it) + it.second.name.size();
+    for (auto& c : it.second.children) {
+      n += node + sizeof(c) + c.pool_namespace.size() + c.image_id.size();
+    }
+  }
+  for (auto& w : info.watchers) {
+    n += sizeof(w) + w.size();
+  }
+  for (auto& it : info.metas) {
+    n += node + sizeof(it) + it.first.size() + it.second.size();
+  }
+  return n;
+}
+
+// sorted map of list_info results which moves to an anonymous temporary
+// file (as a sorted run) whenever the entries held in memory exceed the
+// budget
+//
+// a run is a sequence of <varint key length, key, varint value length,
+// encoded value> records, every `INDEX_INTERVAL`-th key is kept in memory
+// with its offset so a lookup reads at most that many records of a run.
+// all the runs share the file, and `MERGE_FANIN` runs of a level are merged
+// into one of the next level, so there are O(log(spills)) runs to look up
+// and merge, the space of the merged runs is given back to the filesystem
+class spill_map_t {
+public:
+  using value_type = std::pair<librbdx::image_info_t, int>;
+
+  static constexpr uint32_t INDEX_INTERVAL = 64;
+  static constexpr size_t MERGE_FANIN = 8;
+  // per run read buffer, scaled down to the budget when there are many runs
+  static constexpr size_t READ_CHUNK = 64 * 1024;
+  static constexpr size_t MIN_READ_CHUNK = 4 * 1024;
+
+  // `dir` defaults to $TMPDIR, then /tmp
+  spill_map_t(uint64_t budget, const std::string& dir = "")
+    : budget(budget), dir(dir) {
+    if (this->dir.empty()) {
+      const char* tmp = std::getenv("TMPDIR");
+      this->dir = (tmp != nullptr && *tmp) ? tmp : "/tmp";
+    }
+  }
+  ~spill_map_t() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  spill_map_t(const spill_map_t&) = delete;
+  spill_map_t& operator=(const spill_map_t&) = delete;
+
+  // keys are expected to be unique
+  int add(const std::string& key, value_type&& v) {
+    mem_bytes += approx_size(key, v);
+    mem.emplace(key, std::move(v));
+    count++;
+    if (mem_bytes > budget) {
+      int r = spill();
+      if (r < 0) {
+        return r;
+      }
+      return merge_runs();
+    }
+    return 0;
+  }
+
+  uint64_t get_budget() const {
+    return budget;
+  }
+  uint64_t size() const {
+    return count;
+  }
+  size_t num_runs() const {
+    return runs.size();
+  }
+
+  // 0 if found, -ENOENT if not, -errno on I/O errors
+  int get(const std::string& key, value_type* v) const {
+    auto it = mem.find(key);
+    if (it != mem.end()) {
+      *v = it->second;
+      return 0;
+    }
+    for (auto& run : runs) {
+      if (run.index.empty() || key > run.last) {
+        continue;
+      }
+      auto iit = std::upper_bound(run.index.begin(), run.index.end(), key,
+          [](const std::string& k, const std::pair<std::string, uint64_t>& i) {
+            return k < i.first;
+          });
+      if (iit == run.index.begin()) {
+        continue;
+      }
+      --iit;
+      reader_t reader(fd, run, iit->second, MIN_READ_CHUNK);
+      std::string k, bl;
+      for (uint32_t i = 0; i < INDEX_INTERVAL; i++) {
+        int r = reader.next(&k, &bl);
+        if (r < 0) {
+          return r;
+        }
+        if (r == 0 || k > key) {
+          break;
+        }
+        if (k == key) {
+          return decode_value(bl, v);
+        }
+      }
+    }
+    return -ENOENT;
+  }
+
+  // the same blob as `encode_versioned` of a std::map of the entries, so it
+  // is interchangeable with the one of Map_string_2_pair_image_info_t_int,
+  // -errno on I/O errors
+  int dump(std::string* bl) const;
+  // the entries of a blob from `dump` or `encode_versioned` of a std::map,
+  // added as by `add`, -EINVAL for malformed data, -EOPNOTSUPP if encoded
+  // by a newer and incompatible version, -errno on I/O errors
+  int load(const char* p, size_t len);
+
+private:
+  struct run_t {
+    uint64_t off;       // of the first record in the file
+    uint64_t end;
+    uint32_t level = 0; // merged `level` times
+    std::string last;   // the largest key
+    std::vector<std::pair<std::string, uint64_t>> index;
+  };
+
+  class reader_t {
+  public:
+    reader_t(int fd, const run_t& run, uint64_t off, size_t chunk)
+      : fd(fd), run(&run), off(off), chunk(chunk) {}
+
+    // 1 if a record is read, 0 at the end of the run, -errno on errors
+    int next(std::string* key, std::string* bl) {
+      if (off >= run->end) {
+        return 0;
+      }
+      int r = read_bytes(key);
+      if (r < 0) {
+        return r;
+      }
+      r = read_bytes(bl);
+      return (r < 0) ? r : 1;
+    }
+
+  private:
+    int read_byte(uint8_t* b) {
+      if (off >= buf_off + buf.size()) {
+        int r = fill();
+        if (r < 0) {
+          return r;
+        }
+      }
+      *b = static_cast<uint8_t>(buf[off - buf_off]);
+      off++;
+      return 0;
+    }
+    int read_bytes(std::string* s) {
+      uint64_t len = 0;
+      for (int shift = 0; ; shift += 7) {
+        uint8_t b;
+        int r = read_byte(&b);
+        if (r < 0) {
+          return r;
+        }
+        if (shift > 63) {
+          return -EIO;
+        }
+        len |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          break;
+        }
+      }
+      if (off + len > run->end) {
+        return -EIO;
+      }
+      s->clear();
+      s->reserve(len);
+      while (len) {
+        if (off >= buf_off + buf.size()) {
+          int r = fill();
+          if (r < 0) {
+            return r;
+          }
+        }
+        size_t n = std::min<uint64_t>(len, buf_off + buf.size() - off);
+        s->append(buf.data() + (off - buf_off), n);
+        off += n;
+        len -= n;
+      }
+      return 0;
+    }
+    int fill() {
+      // never past the run, the next one may be merged away already
+      buf.resize(std::min<uint64_t>(chunk, run->end - off));
+      ssize_t n;
+      do {
+        n = ::pread(fd, &buf[0], buf.size(), off);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        return -errno;
+      }
+      if (n == 0) {
+        return -EIO;
+      }
+      buf.resize(n);
+      buf_off = off;
+      return 0;
+    }
+
+    int fd;
+    const run_t* run;
+    uint64_t off;
+    size_t chunk;
+    std::string buf;
+    uint64_t buf_off = 0;
+  };
+
+  // k-way merge of runs, the heads are kept in a min-heap by key
+  class merger_t {
+  public:
+    merger_t(int fd, const std::vector<const run_t*>& runs, size_t chunk) {
+      heads.reserve(runs.size());
+      for (auto* run : runs) {
+        heads.emplace_back(fd, *run, chunk);
+      }
+    }
+
+    // the head with the smallest key, or null at the end, valid until
+    // `pop`, -errno on I/O errors
+    int top(const std::string** key, const std::string** bl) {
+      if (!started) {
+        started = true;
+        for (size_t i = 0; i < heads.size(); i++) {
+          int r = load(i);
+          if (r < 0) {
+            return r;
+          }
+        }
+      }
+      if (heap.empty()) {
+        *key = nullptr;
+        return 0;
+      }
+      auto& h = heads[heap.front()];
+      *key = &h.key;
+      *bl = &h.bl;
+      return 0;
+    }
+    int pop() {
+      std::pop_heap(heap.begin(), heap.end(), greater_t{this});
+      size_t i = heap.back();
+      heap.pop_back();
+      return load(i);
+    }
+
+  private:
+    struct head_t {
+      head_t(int fd, const run_t& run, size_t chunk)
+        : reader(fd, run, run.off, chunk) {}
+
+      reader_t reader;
+      std::string key;
+      std::string bl;
+    };
+
+    struct greater_t {
+      const merger_t* m;
+      bool operator()(size_t a, size_t b) const {
+        return m->heads[a].key > m->heads[b].key;
+      }
+    };
+
+    int load(size_t i) {
+      auto& h = heads[i];
+      int r = h.reader.next(&h.key, &h.bl);
+      if (r <= 0) {
+        return r;
+      }
+      heap.push_back(i);
+      std::push_heap(heap.begin(), heap.end(), greater_t{this});
+      return 0;
+    }
+
+    std::vector<head_t> heads;
+    std::vector<size_t> heap;
+    bool started = false;
+  };
+
+  // appends a run at `off` of the file
+  class writer_t {
+  public:
+    writer_t(int fd, uint64_t off) : fd(fd) {
+      run.off = off;
+      run.end = off;
+    }
+
+    int add(const std::string& key, const std::string& value_bl) {
+      if (n++ % INDEX_INTERVAL == 0) {
+        run.index.emplace_back(key, run.end + bl.size());
+      }
+      encoder_t e(&bl);
+      e.put_bytes(key.data(), key.size());
+      e.put_bytes(value_bl.data(), value_bl.size());
+      run.last = key;
+      if (bl.size() >= READ_CHUNK) {
+        return flush();
+      }
+      return 0;
+    }
+    int flush() {
+      int r = write_all(fd, bl, run.end);
+      if (r < 0) {
+        return r;
+      }
+      run.end += bl.size();
+      bl.clear();
+      return 0;
+    }
+
+    run_t run;
+
+  private:
+    int fd;
+    std::string bl;
+    uint64_t n = 0;
+  };
+
+  static int decode_value(const std::string& bl, value_type* v) {
+    decoder_t d(bl.data(), bl.size());
+    return decode(v, &d) ? 0 : -EIO;
+  }
+
+  size_t read_chunk(size_t num_runs) const {
+    uint64_t chunk = budget / std::max<size_t>(num_runs, 1);
+    if (chunk > READ_CHUNK) {
+      return READ_CHUNK;
+    }
+    return (chunk < MIN_READ_CHUNK) ? MIN_READ_CHUNK : chunk;
+  }
+
+  std::vector<const run_t*> all_runs() const {
+    std::vector<const run_t*> r;
+    r.reserve(runs.size());
+    for (auto& run : runs) {
+      r.push_back(&run);
+    }
+    return r;
+  }
+
+public:
+  // iterates in key order, merging the runs and the in-memory entries
+  class cursor_t {
+  public:
+    explicit cursor_t(const spill_map_t& m)
+      : m(&m), mem_it(m.mem.begin()),
+        merger(m.fd, m.all_runs(), m.read_chunk(m.runs.size())) {}
+
+    // 1 if there is an entry, 0 at the end, -errno on I/O errors
+    int next(std::string* key, value_type* v) {
+      const std::string* k;
+      const std::string* bl;
+      int r = merger.top(&k, &bl);
+      if (r < 0) {
+        return r;
+      }
+      if (mem_it != m->mem.end() && (k == nullptr || mem_it->first < *k)) {
+        *key = mem_it->first;
+        *v = mem_it->second;
+        ++mem_it;
+        return 1;
+      }
+      if (k == nullptr) {
+        return 0;
+      }
+      *key = *k;
+      r = decode_value(*bl, v);
+      if (r < 0) {
+        return r;
+      }
+      r = merger.pop();
+      return (r < 0) ? r : 1;
+    }
+
+  private:
+    const spill_map_t* m;
+    std::map<std::string, value_type>::const_iterator mem_it;
+    merger_t merger;
+  };
+
+private:
+  static int write_all(int fd, const std::string& bl, uint64_t off) {
+    size_t done = 0;
+    while (done < bl.size()) {
+      ssize_t n = ::pwrite(fd, bl.data() + done, bl.size() - done, off + done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -errno;
+      }
+      done += n;
+    }
+    return 0;
+  }
+
+  int open_file() {
+    if (fd >= 0) {
+      return 0;
+    }
+    std::string path = dir + "/rbdx-spill-XXXXXX";
+    fd = ::mkstemp(&path[0]);
+    if (fd < 0) {
+      return -errno;
+    }
+    // anonymous from now on, so it is gone with the fd even if we crash
+    ::unlink(path.c_str());
+    return 0;
+  }
+
+  // best effort, the space is given back with the file otherwise
+  void punch(const run_t& run) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (run.end > run.off) {
+      (void)::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+          run.off, run.end - run.off);
+    }
+#endif
+  }
+
+  int spill() {
+    int r = open_file();
+    if (r < 0) {
+      return r;
+    }
+    writer_t w(fd, file_end);
+    std::string value;
+    for (auto& it : mem) {
+      value.clear();
+      encoder_t e(&value);
+      encode(it.second, &e);
+      r = w.add(it.first, value);
+      if (r < 0) {
+        return r;
+      }
+    }
+    r = w.flush();
+    if (r < 0) {
+      return r;
+    }
+    file_end = w.run.end;
+    runs.push_back(std::move(w.run));
+    mem.clear();
+    mem_bytes = 0;
+    return 0;
+  }
+
+  // the levels do not increase towards the back, where the new runs are
+  // added, so the runs to merge are always the last `MERGE_FANIN` ones
+  int merge_runs() {
+    while (runs.size() >= MERGE_FANIN) {
+      size_t first = runs.size() - MERGE_FANIN;
+      uint32_t level = runs.back().level;
+      if (runs[first].level != level) {
+        return 0;
+      }
+      std::vector<const run_t*> merging;
+      for (size_t i = first; i < runs.size(); i++) {
+        merging.push_back(&runs[i]);
+      }
+      merger_t merger(fd, merging, read_chunk(merging.size()));
+      writer_t w(fd, file_end);
+      while (true) {
+        const std::string* key;
+        const std::string* bl;
+        int r = merger.top(&key, &bl);
+        if (r < 0) {
+          return r;
+        }
+        if (key == nullptr) {
+          break;
+        }
+        r = w.add(*key, *bl);
+        if (r < 0) {
+          return r;
+        }
+        r = merger.pop();
+        if (r < 0) {
+          return r;
+        }
+      }
+      int r = w.flush();
+      if (r < 0) {
+        return r;
+      }
+      for (size_t i = first; i < runs.size(); i++) {
+        punch(runs[i]);
+      }
+      runs.erase(runs.begin() + first, runs.end());
+      w.run.level = level + 1;
+      file_end = w.run.end;
+      runs.push_back(std::move(w.run));
+    }
+    return 0;
+  }
+
+  uint64_t budget;
+  std::string dir;
+  std::map<std::string, value_type> mem;
+  uint64_t mem_bytes = 0;
+  uint64_t count = 0;
+  int fd = -1;
+  uint64_t file_end = 0;
+  std::vector<run_t> runs;
+};
+
+inline int spill_map_t::dump(std::string* bl) const {
+  encoder_t e(bl);
+  e.put_u8(ENCODING_V);
+  e.put_u8(ENCODING_COMPAT_V);
+  e.put_varint(count);
+  cursor_t cursor(*this);
+  std::string key;
+  value_type v;
+  while (true) {
+    int r = cursor.next(&key, &v);
+    if (r < 0) {
+      return r;
+    }
+    if (r == 0) {
+      return 0;
+    }
+    encode(key, &e);
+    encode(v, &e);
+  }
+}
+
+inline int spill_map_t::load(const char* p, size_t len) {
+  decoder_t d(p, len);
+  uint8_t v, compat_v;
+  uint64_t n;
+  if (!d.get_u8(&v) || !d.get_u8(&compat_v)) {
+    return -EINVAL;
+  }
+  if (compat_v > ENCODING_V) {
+    return -EOPNOTSUPP;
+  }
+  if (!d.get_length(&n)) {
+    return -EINVAL;
+  }
+  while (n--) {
+    std::string key;
+    value_type o;
+    if (!decode(&key, &d) || !decode(&o, &d)) {
+      return -EINVAL;
+    }
+    int r = add(key, std::move(o));
+    if (r < 0) {
+      return r;
+    }
+  }
+  // newer compatible versions may have appended data, ignore it
+  if (v == ENCODING_V && !d.empty()) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_SPILL_H_ */
@@ -0,0 +1,269 @@
+/*
+ * throttle.h
+ */
+
+#ifndef SRC_RBDX_THROTTLE_H_
+#define SRC_RBDX_THROTTLE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "deadline.h"
+
+namespace rbdx {
+
+enum class throttle_policy_t : uint32_t {
+  THROTTLE_POLICY_NONE      = 0,  // fixed window of `max_inflight`
+  THROTTLE_POLICY_AIMD      = 1,  // +1 per window under target, halved over
+  THROTTLE_POLICY_GRADIENT  = 2   // scaled by target / observed latency
+};
+
+inline std::string stringify(const throttle_policy_t& o) {
+  switch (o) {
+  case throttle_policy_t::THROTTLE_POLICY_NONE:
+    return "none";
+  case throttle_policy_t::THROTTLE_POLICY_AIMD:
+    return "aimd";
+  case throttle_policy_t::THROTTLE_POLICY_GRADIENT:
+    return "gradient";
+  default:
+    return "unknown";
+  }
+}
+
+// process wide, the window and the rate are in images
+struct throttle_config_t {
+  throttle_policy_t policy = throttle_policy_t::THROTTLE_POLICY_NONE;
+  uint32_t min_inflight = 1;
+  uint32_t max_inflight = 128;
+  uint64_t target_latency_us = 50000;
+  // token bucket, images per second and bucket size, 0 means unlimited
+  uint64_t ops_rate = 0;
+  uint64_t ops_burst = 0;
+};
+
+struct throttle_state_t {
+  throttle_config_t config;
+  uint32_t window;          // current in-flight window
+  uint32_t inflight;        // images in flight
+  uint64_t tokens;          // tokens left in the bucket
+  uint64_t latency_us;      // smoothed per-image latency
+  uint64_t ops;             // images done
+  uint64_t throttled_ops;   // images that had to wait for the window or tokens
+};
+
+// admission of the calls rbdx makes to librbdx, i.e., get_info of an image
+// and list_info of a batch of images (see batch_scan_t), by an in-flight
+// window and a token bucket, both counted in images, so the get_info
+// calls and the list_info scans share the same limits
+//
+// a call of n images takes n slots of the window and n tokens, one larger
+// than the window or the bucket is admitted once the window is empty or
+// the bucket is full, so it is not starved. the latency of a call is
+// divided by its images, i.e., the latency of a batch is amortized over
+// the images librbdx pipelines in it, so it is comparable to the one of a
+// get_info
+//
+// the window is fixed at `max_inflight` for THROTTLE_POLICY_NONE, grows by
+// one per window of images under `target_latency_us` and is halved (at
+// most once per window) over it for THROTTLE_POLICY_AIMD, and is scaled by
+// target / smoothed latency for THROTTLE_POLICY_GRADIENT
+class throttle_t {
+public:
+  using clock = std::chrono::steady_clock;
+
+  static int validate(const throttle_config_t& config) {
+    if (config.min_inflight == 0 || config.max_inflight == 0 ||
+        config.min_inflight > config.max_inflight) {
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  int set_config(const throttle_config_t& config) {
+    int r = validate(config);
+    if (r < 0) {
+      return r;
+    }
+    std::lock_guard<std::mutex> l(lock);
+    this->config = config;
+    if (config.policy == throttle_policy_t::THROTTLE_POLICY_NONE) {
+      window = config.max_inflight;
+    } else {
+      window = clamp(window);
+    }
+    tokens = burst();
+    refilled = clock::now();
+    cond.notify_all();
+    return 0;
+  }
+
+  throttle_state_t get_state() {
+    std::lock_guard<std::mutex> l(lock);
+    refill(clock::now());
+    throttle_state_t state;
+    state.config = config;
+    state.window = static_cast<uint32_t>(window);
+    state.inflight = inflight;
+    state.tokens = static_cast<uint64_t>(std::max(0.0, tokens));
+    state.latency_us = static_cast<uint64_t>(latency_us);
+    state.ops = ops;
+    state.throttled_ops = throttled_ops;
+    return state;
+  }
+
+  // 0 once `n` images are admitted, -ETIMEDOUT or -ECANCELED otherwise,
+  // must be paired with `release` of the same `n` if admitted
+  int acquire(uint32_t n, const deadline_t& deadline,
+      cancel_token_t* token) {
+    std::unique_lock<std::mutex> l(lock);
+    bool waited = false;
+    while (true) {
+      if (token != nullptr && token->is_canceled()) {
+        return -ECANCELED;
+      }
+      auto now = clock::now();
+      refill(now);
+      bool has_slot = inflight == 0 ||
+          inflight + n <= static_cast<uint32_t>(window);
+      double need = std::min<double>(n, burst());
+      bool has_token = config.ops_rate == 0 || tokens >= need;
+      if (has_slot && has_token) {
+        break;
+      }
+      if (now >= deadline) {
+        return -ETIMEDOUT;
+      }
+      waited = true;
+      // wake up now and then to check the token, which does not notify
+      auto until = std::min(deadline, now + poll_interval());
+      if (!has_token) {
+        auto d = std::chrono::duration<double>((need - tokens) / config.ops_rate);
+        until = std::min(until,
+            now + std::chrono::duration_cast<clock::duration>(d));
+      }
+      cond.wait_until(l, until);
+    }
+    // may go negative for a call larger than the bucket, which the calls
+    // after it pay for
+    if (config.ops_rate != 0) {
+      tokens -= n;
+    }
+    inflight += n;
+    if (waited) {
+      throttled_ops += n;
+    }
+    return 0;
+  }
+
+  void release(uint32_t n, clock::duration latency) {
+    std::lock_guard<std::mutex> l(lock);
+    inflight -= n;
+    ops += n;
+    double us = std::chrono::duration<double, std::micro>(latency).count() /
+        std::max<uint32_t>(1, n);
+    latency_us = (latency_us == 0) ? us : latency_us + (us - latency_us) / 8;
+    adjust(n, us);
+    cond.notify_all();
+  }
+
+private:
+  static clock::duration poll_interval() {
+    return std::chrono::milliseconds(100);
+  }
+
+  double burst() const {
+    if (config.ops_burst != 0) {
+      return config.ops_burst;
+    }
+    return std::max<double>(1, config.ops_rate);
+  }
+
+  void refill(clock::time_point now) {
+    if (config.ops_rate == 0) {
+      return;
+    }
+    double elapsed = std::chrono::duration<double>(now - refilled).count();
+    tokens = std::min(burst(), tokens + elapsed * config.ops_rate);
+    refilled = now;
+  }
+
+  double clamp(double w) const {
+    return std::max<double>(config.min_inflight,
+        std::min<double>(config.max_inflight, w));
+  }
+
+  void adjust(uint32_t n, double us) {
+    double target = config.target_latency_us;
+    switch (config.policy) {
+    case throttle_policy_t::THROTTLE_POLICY_AIMD:
+      if (us > target) {
+        if (ops - decreased_at >= static_cast<uint64_t>(window)) {
+          window /= 2;
+          decreased_at = ops;
+        }
+      } else {
+        window += n / window;
+      }
+      break;
+    case throttle_policy_t::THROTTLE_POLICY_GRADIENT: {
+      double gradient = std::max(0.5, std::min(2.0, target / std::max(1.0, latency_us)));
+      // move a tenth of the way per call, a single outlier does not halve it
+      window += window * (gradient - 1) / 10;
+      break;
+    }
+    default:
+      window = config.max_inflight;
+      break;
+    }
+    window = clamp(window);
+  }
+
+  std::mutex lock;
+  std::condition_variable cond;
+  throttle_config_t config;
+  double window = throttle_config_t{}.max_inflight;
+  uint32_t inflight = 0;
+  double tokens = 0;
+  clock::time_point refilled = clock::now();
+  double latency_us = 0;      // smoothed
+  uint64_t ops = 0;
+  uint64_t throttled_ops = 0;
+  uint64_t decreased_at = 0;
+};
+
+// `n` images admitted on construction if r is 0, released on destruction
+class throttle_op_t {
+public:
+  throttle_op_t(throttle_t* throttle, uint32_t n,
+      const deadline_t& deadline,
+      cancel_token_t* token)
+    : throttle(throttle), n(n) {
+    r = throttle->acquire(n, deadline, token);
+    start = throttle_t::clock::now();
+  }
+  ~throttle_op_t() {
+    if (r == 0) {
+      throttle->release(n, throttle_t::clock::now() - start);
+    }
+  }
+
+  throttle_op_t(const throttle_op_t&) = delete;
+  throttle_op_t& operator=(const throttle_op_t&) = delete;
+
+  int r;
+
+private:
+  throttle_t* throttle;
+  uint32_t n;
+  throttle_t::clock::time_point start;
+};
+
+} // namespace rbdx
+
+#endif /* SRC_RBDX_THROTTLE_H_ */
@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+#
+# times what a short-lived tool pays before its first result: importing
+# radosx/rbdx, attaching to the cluster and one get_info, each run in a
+# fresh interpreter so the import is not cached
+#
+#   python bench_startup.py -c /etc/ceph/ceph.conf -p rbd -n 20 image_name
+#
+# with --capsule the xRados attaches to a connected rados.Rados via
+# `from_rados`, the argument names the rados.Rados method that returns its
+# "rados" capsule, otherwise the xRados connects by itself
+#
+
+from __future__ import print_function
+
+import argparse
+import json
+import subprocess
+import sys
+
+CHILD = r'''
+import json, sys, time
+args = json.loads(sys.argv[1])
+t = {}
+
+if args['capsule']:
+    import rados
+    cluster = rados.Rados(conffile=args['conf'], rados_id=args['id'])
+    cluster.connect()
+
+t0 = time.time()
+import radosx
+import rbdx
+t['import'] = time.time() - t0
+
+t0 = time.time()
+xrados = radosx.xRados()
+if args['capsule']:
+    r = xrados.from_rados(getattr(cluster, args['capsule'])())
+else:
+    r = xrados.init(args['id'])
+    if r == 0:
+        r = xrados.conf_read_file(args['conf'])
+    if r == 0:
+        r = xrados.connect()
+if r < 0:
+    sys.exit('attach failed: %d' % r)
+t['attach'] = time.time() - t0
+
+t0 = time.time()
+ioctx = radosx.xIoCtx()
+r = xrados.ioctx_create(args['pool'], ioctx)
+if r < 0:
+    sys.exit('ioctx_create failed: %d' % r)
+t['ioctx_create'] = time.time() - t0
+
+t0 = time.time()
+info, r = rbdx.get_info(ioctx, args['image'], '')
+if r < 0:
+    sys.exit('get_info failed: %d' % r)
+t['get_info'] = time.time() - t0
+
+ioctx.close()
+xrados.shutdown()
+if args['capsule']:
+    cluster.shutdown()
+print(json.dumps(t))
+'''
+
+PHASES = ('import', 'attach', 'ioctx_create', 'get_info')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-c', '--conf', default='/etc/ceph/ceph.conf')
+    parser.add_argument('-i', '--id', default='admin')
+    parser.add_argument('-p', '--pool', default='rbd')
+    parser.add_argument('-n', '--runs', type=int, default=10)
+    parser.add_argument('--capsule', default='',
+                        help='rados.Rados method returning its capsule')
+    parser.add_argument('image')
+    args = parser.parse_args()
+
+    child_args = json.dumps(vars(args))
+    samples = dict((p, []) for p in PHASES)
+    for _ in range(args.runs):
+        out = subprocess.check_output([sys.executable, '-c', CHILD, child_args])
+        t = json.loads(out.decode().strip().splitlines()[-1])
+        for p in PHASES:
+            samples[p].append(t[p] * 1000)
+
+    print('{0:<14}{1:>10}{2:>10}{3:>10}'.format('ms', 'min', 'median', 'max'))
+    totals = [sum(samples[p][i] for p in PHASES) for i in range(args.runs)]
+    for name, s in [(p, samples[p]) for p in PHASES] + [('total', totals)]:
+        s = sorted(s)
+        print('{0:<14}{1:>10.2f}{2:>10.2f}{3:>10.2f}'.format(
+            name, s[0], s[len(s) // 2], s[-1]))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,138 @@
+#!/usr/bin/env python
+#
+# hammers rbdx.get_info/list_info from several threads while the xIoCtx is
+# closed and the xRados is shutdown under them, the calls must either
+# succeed or fail with -EBADF, and the process must not crash
+#
+#   python stress_shutdown.py -c /etc/ceph/ceph.conf -p rbd -r 50
+#
+
+from __future__ import print_function
+
+import argparse
+import errno
+import random
+import sys
+import threading
+import time
+
+import radosx
+import rbdx
+
+
+# errors a call may see when it races with close/shutdown, or with the
+# images being removed by others
+EXPECTED = (0, -errno.EBADF, -errno.ENOENT, -errno.ETIMEDOUT, -errno.ECANCELED)
+
+
+class Worker(threading.Thread):
+    def __init__(self, ioctx, images, stop, timeout):
+        super(Worker, self).__init__()
+        self.daemon = True
+        self.ioctx = ioctx
+        self.images = images
+        self.stop = stop
+        self.timeout = timeout
+        self.calls = 0
+        self.errors = {}
+
+    def check(self, what, r):
+        self.calls += 1
+        if r not in EXPECTED:
+            self.errors[(what, r)] = self.errors.get((what, r), 0) + 1
+
+    def run(self):
+        while not self.stop.is_set():
+            if self.images and random.random() < 0.8:
+                image_id, image_name = random.choice(self.images)
+                _, r = rbdx.get_info(self.ioctx, image_name, image_id,
+                                     timeout=self.timeout)
+                self.check('get_info', r)
+            else:
+                _, r = rbdx.list_info(self.ioctx, timeout=self.timeout)
+                self.check('list_info', r)
+
+
+def connect(args):
+    rados = radosx.xRados()
+    r = rados.init(args.id)
+    if r < 0:
+        raise OSError(-r, 'init failed')
+    r = rados.conf_read_file(args.conf)
+    if r < 0:
+        raise OSError(-r, 'conf_read_file failed')
+    r = rados.connect()
+    if r < 0:
+        raise OSError(-r, 'connect failed')
+    ioctx = radosx.xIoCtx()
+    r = rados.ioctx_create(args.pool, ioctx)
+    if r < 0:
+        raise OSError(-r, 'ioctx_create failed')
+    return rados, ioctx
+
+
+def run_round(args):
+    rados, ioctx = connect(args)
+    images, r = rbdx.list(ioctx)
+    if r < 0:
+        raise OSError(-r, 'list failed')
+    images = list(images.items())
+
+    stop = threading.Event()
+    workers = [Worker(ioctx, images, stop, args.timeout)
+               for _ in range(args.threads)]
+    for w in workers:
+        w.start()
+
+    time.sleep(random.uniform(0, args.delay))
+    # either pull the ioctx first or shutdown with it still open, the
+    # latter drops the last python reference on the xRados too, so the
+    # destructor path is covered as well
+    choice = random.randint(0, 2)
+    if choice == 0:
+        ioctx.close()
+        rados.shutdown()
+    elif choice == 1:
+        rados.shutdown()
+    else:
+        del rados
+
+    # calls made after shutdown must be rejected, not crash
+    time.sleep(random.uniform(0, args.delay))
+    stop.set()
+    for w in workers:
+        w.join()
+
+    calls = sum(w.calls for w in workers)
+    errors = {}
+    for w in workers:
+        for k, v in w.errors.items():
+            errors[k] = errors.get(k, 0) + v
+    return calls, errors
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-c', '--conf', default='/etc/ceph/ceph.conf')
+    parser.add_argument('-i', '--id', default='admin')
+    parser.add_argument('-p', '--pool', default='rbd')
+    parser.add_argument('-t', '--threads', type=int, default=16)
+    parser.add_argument('-r', '--rounds', type=int, default=20)
+    parser.add_argument('-d', '--delay', type=float, default=0.5,
+                        help='max seconds before and after the shutdown')
+    parser.add_argument('--timeout', type=float, default=0.0,
+                        help='timeout of the calls, 0 (default) for none')
+    args = parser.parse_args()
+
+    failed = False
+    for i in range(args.rounds):
+        calls, errors = run_round(args)
+        print('round {0}: {1} calls'.format(i, calls))
+        for (what, r), n in sorted(errors.items()):
+            print('  {0} returned {1} {2} times'.format(what, r, n))
+            failed = True
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())